@@ -44,23 +44,220 @@
  * References: Microchip MCP2515 data sheet, DS21801E, 2007.
  */
 
+#include <linux/clk.h>
+#include <linux/bitmap.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/dma-mapping.h>
+#include <linux/ethtool.h>
+#include <linux/filter.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mod_devicetable.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/net_tstamp.h>
 #include <linux/netdevice.h>
+#include <linux/pkt_sched.h>
+#include <linux/pm_runtime.h>
+#include <linux/property.h>
+#include <linux/rcupdate.h>
+#include <linux/regulator/consumer.h>
+#include <linux/rtnetlink.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/spi/spi.h>
 #include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/platform/mcp251x.h>
+#include <net/xdp.h>
 
 MODULE_DESCRIPTION("Driver for Microchip MCP2515 SPI CAN controller");
 MODULE_AUTHOR("Andre B. Oliveira <anbadeol@gmail.com>, "
 	      "Marc Kleine-Budde <mkl@pengutronix.de>");
 MODULE_LICENSE("GPL");
 
+/*
+ * How to read the receive buffers: in one 14 byte READ RX BUFFER
+ * transaction, or header first and then only DLC data bytes.
+ */
+enum {
+	MCP2515_RX_READ_AUTO,	/* pick the cheaper one from measured costs */
+	MCP2515_RX_READ_FULL,
+	MCP2515_RX_READ_SPLIT,
+};
+
+static int rx_read_mode = MCP2515_RX_READ_AUTO;
+module_param(rx_read_mode, int, 0644);
+MODULE_PARM_DESC(rx_read_mode,
+		 "receive buffer read strategy (0=auto, 1=full, 2=split)");
+
+/*
+ * How to request the interrupt.  On an edge, the SPI engine drains the
+ * chip from the hard interrupt handler.  On a level, with the line
+ * masked, a threaded handler waits for the engine to find CANINTF clear,
+ * so the line can't be left asserted with work pending.  Shared is a
+ * level shared by several chips, served by one dispatcher per line.
+ */
+enum {
+	MCP2515_IRQ_EDGE,
+	MCP2515_IRQ_LEVEL,
+	MCP2515_IRQ_SHARED,
+};
+
+static int irq_mode = MCP2515_IRQ_EDGE;
+module_param(irq_mode, int, 0644);
+MODULE_PARM_DESC(irq_mode, "interrupt trigger, applied on open "
+		 "(0=falling edge, 1=low level, 2=shared low level)");
+
+/*
+ * Budget of a service cycle, the run of the SPI engine since it last went
+ * idle or yielded.  Once spent, the engine leaves the SPI bus to other
+ * devices for service_yield_us before it reads the flags again.
+ */
+static unsigned int service_budget;
+static unsigned int service_budget_us;
+
+/*
+ * Optional per-frame features are behind static keys, so that with none
+ * of them enabled the frame path runs without them, not even a test:
+ * hardware timestamps while a device has them enabled (SIOCSHWTSTAMP),
+ * the service budget while one is set, hot path profiling, per CAN ID
+ * statistics while a running device has them enabled, and the software
+ * receive filter, XDP and the change filter while a device uses them.
+ */
+static DEFINE_STATIC_KEY_FALSE(mcp2515_hwtstamp_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_budget_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_profile_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_id_stats_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_sw_filter_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_xdp_key);
+static DEFINE_STATIC_KEY_FALSE(mcp2515_rx_changed_key);
+
+static int mcp2515_budget_param_set(const char *val,
+				    const struct kernel_param *kp)
+{
+	int err = param_set_uint(val, kp);
+
+	if (err)
+		return err;
+
+	if (service_budget || service_budget_us)
+		static_branch_enable(&mcp2515_budget_key);
+	else
+		static_branch_disable(&mcp2515_budget_key);
+
+	return 0;
+}
+
+static const struct kernel_param_ops mcp2515_budget_param_ops = {
+	.set = mcp2515_budget_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(service_budget, &mcp2515_budget_param_ops,
+		&service_budget, 0644);
+MODULE_PARM_DESC(service_budget,
+		 "SPI transactions per service cycle (0=unlimited)");
+
+module_param_cb(service_budget_us, &mcp2515_budget_param_ops,
+		&service_budget_us, 0644);
+MODULE_PARM_DESC(service_budget_us,
+		 "duration of a service cycle in us (0=unlimited)");
+
+static unsigned int service_yield_us = 50;
+module_param(service_yield_us, uint, 0644);
+MODULE_PARM_DESC(service_yield_us,
+		 "pause after a spent service cycle in us");
+
+static bool profile;
+
+static int mcp2515_profile_param_set(const char *val,
+				     const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+
+	if (err)
+		return err;
+
+	if (profile)
+		static_branch_enable(&mcp2515_profile_key);
+	else
+		static_branch_disable(&mcp2515_profile_key);
+
+	return 0;
+}
+
+static const struct kernel_param_ops mcp2515_profile_param_ops = {
+	.set = mcp2515_profile_param_set,
+	.get = param_get_bool,
+};
+
+module_param_cb(profile, &mcp2515_profile_param_ops, &profile, 0644);
+MODULE_PARM_DESC(profile, "measure the receive and transmit hot paths");
+
+/*
+ * Interrupt line shared by several chips.  The dispatcher finds the
+ * chips with pending interrupts, starts all their SPI engines, and waits
+ * for all of them to drain their chip before the line is unmasked.
+ */
+struct mcp2515_irq_line {
+	struct list_head node;	/* in mcp2515_irq_lines */
+	int irq;
+	struct mutex lock;	/* Lock for the following: */
+	struct list_head chips;	/* mcp2515_priv.irq_node, rotated */
+	ktime_t tstamp;		/* time of the last interrupt */
+};
+
+static LIST_HEAD(mcp2515_irq_lines);
+static DEFINE_MUTEX(mcp2515_irq_lines_lock);
+
+/*
+ * Urgency of an SPI transaction, for the scheduling among the chips on an
+ * SPI controller.
+ */
+enum {
+	MCP2515_URGENCY_LOW,		/* transmit and housekeeping */
+	MCP2515_URGENCY_RX,		/* events to read, a frame to receive */
+	MCP2515_URGENCY_OVERFLOW,	/* both receive buffers full */
+	MCP2515_URGENCY_LEVELS,
+};
+
+/*
+ * Chips sharing an SPI controller.  Each chip has at most one transaction
+ * submitted or queued; beyond MCP2515_BUS_INFLIGHT submitted ones, they
+ * are queued by urgency instead of piling up in the controller queue in
+ * FIFO order.
+ */
+struct mcp2515_spi_bus {
+	struct list_head node;	/* in mcp2515_spi_buses */
+	struct spi_controller *ctlr;
+	int users;		/* under mcp2515_spi_buses_lock */
+	spinlock_t lock;	/* Lock for the following: */
+	unsigned int inflight;	/* transactions submitted */
+	struct list_head queue[MCP2515_URGENCY_LEVELS];	/* mcp2515_priv.bus_node */
+};
+
+static LIST_HEAD(mcp2515_spi_buses);
+static DEFINE_MUTEX(mcp2515_spi_buses_lock);
+
 /* SPI interface instruction set */
 #define MCP2515_INSTRUCTION_WRITE	0x02
 #define MCP2515_INSTRUCTION_READ	0x03
@@ -68,6 +265,8 @@ MODULE_LICENSE("GPL");
 #define MCP2515_INSTRUCTION_LOAD_TXB(n)	(0x40 + ((n) << 1))
 #define MCP2515_INSTRUCTION_RTS(n)	(0x80 + (1 << (n)))
 #define MCP2515_INSTRUCTION_READ_RXB(n)	(0x90 + ((n) << 2))
+#define MCP2515_INSTRUCTION_READ_RXB_DATA(n)	(0x92 + ((n) << 2))
+#define MCP2515_INSTRUCTION_READ_STATUS	0xa0
 #define MCP2515_INSTRUCTION_RESET	0xc0
 
 /* Registers */
@@ -75,11 +274,16 @@ MODULE_LICENSE("GPL");
 #define CANCTRL				0x0f
 #define TEC				0x1c
 #define REC				0x1d
+#define CANINTE				0x2b
 #define CANINTF				0x2c
 #define EFLAG				0x2d
 #define CNF3				0x28
+#define CNF2				0x29
+#define CNF1				0x2a
+#define TXBCTRL(n)			(0x30 + ((n) << 4))
 #define RXB0CTRL			0x60
 #define RXB1CTRL			0x70
+#define RXBSIDH(n)			(0x61 + ((n) << 4))
 
 /* CANCTRL bits */
 #define CANCTRL_REQOP_NORMAL		0x00
@@ -100,11 +304,27 @@ MODULE_LICENSE("GPL");
 #define CANINTF_ERRIF			BIT(5)
 #define CANINTF_WAKIF			BIT(6)
 #define CANINTF_MERRF			BIT(7)
+#define CANINTF_RX			(CANINTF_RX0IF | CANINTF_RX1IF)
+#define CANINTF_TX \
+	(CANINTF_TX0IF | CANINTF_TX1IF | CANINTF_TX2IF)
 
 /* EFLG bits */
 #define EFLG_RX0OVR			BIT(6)
 #define EFLG_RX1OVR			BIT(7)
 
+/* READ STATUS bits */
+#define STATUS_RX0IF			BIT(0)
+#define STATUS_RX1IF			BIT(1)
+#define STATUS_TXREQ(n)			BIT(2 + ((n) << 1))
+#define STATUS_TXIF(n)			BIT(3 + ((n) << 1))
+#define STATUS_TXREQ_ALL \
+	(STATUS_TXREQ(0) | STATUS_TXREQ(1) | STATUS_TXREQ(2))
+
+/* TXBnCTRL bits */
+#define TXBCTRL_TXP_MASK		0x03
+#define TXBCTRL_TXREQ			BIT(3)
+#define TXBCTRL_ABTF			BIT(6)
+
 /* CNF2 bits */
 #define CNF2_BTLMODE			BIT(7)
 #define CNF2_SAM			BIT(6)
@@ -138,27 +358,462 @@ MODULE_LICENSE("GPL");
 
 #define MCP2515_DMA_SIZE		32
 
+/* Transfers at least this long calibrate the per-byte SPI cost */
+#define MCP2515_SPI_COST_LONG		9
+/* Transfers taking longer than this are scheduling noise, not SPI cost */
+#define MCP2515_SPI_COST_MAX_NS		NSEC_PER_MSEC
+/* One transfer in this many is timed, prime not to follow a pattern */
+#define MCP2515_SPI_COST_SAMPLE		31
+
+/* RX ring depth, settable with ethtool -G */
+#define MCP2515_RX_RING_DEFAULT		64
+#define MCP2515_RX_RING_MIN		4
+#define MCP2515_RX_RING_MAX		4096
+
+#define MCP2515_NAPI_WEIGHT		32
+
+/*
+ * One TX queue per transmit buffer.  TXBn has transmit priority n, so
+ * queue 2 is the most urgent one.
+ */
+#define MCP2515_TX_BUFS			3
+
+/*
+ * Transactions of all chips on an SPI controller submitted at once: one
+ * transferring and one ready behind it keep the controller busy.
+ */
+#define MCP2515_BUS_INFLIGHT		2
+
+/* Extended IDs tracked per device, and slots probed for one */
+#define MCP2515_EFF_SLOTS		1024
+#define MCP2515_EFF_PROBES		16
+
+/* Extended IDs in the software receive filter */
+#define MCP2515_SW_FILTER_EFF_MAX	128
+
+/* IDs in the change filter */
+#define MCP2515_RX_CHANGED_MAX		64
+
+/* Entries of the cyclic TX engine, and their shortest period */
+#define MCP2515_CYCLIC_MAX		32
+#define MCP2515_CYCLIC_PERIOD_MIN_US	100
+
+/* Oscillator frequency range */
+#define MCP2515_OSC_MIN			1000000
+#define MCP2515_OSC_MAX			25000000
+
+/* Size of the register map */
+#define MCP2515_NREGS			0x80
+
+/* Clean cached registers a burst write may span to join two dirty ones */
+#define MCP2515_REG_GAP			2
+
+/*
+ * A mode change waits for the frame on the bus to end: at most a stuffed
+ * 8 byte extended frame and the interframe space.  Leaving sleep mode
+ * first takes the oscillator start-up timer, 128 oscillator cycles.
+ */
+#define MCP2515_MODE_MAX_BITS		171
+#define MCP2515_MODE_OST_CYCLES		128
+#define MCP2515_MODE_POLL_MIN_US	10
+#define MCP2515_MODE_POLL_MAX_US	1000
+#define MCP2515_MODE_TIMEOUT_MIN_US	10000
+#define MCP2515_MODE_TIMEOUT_FRAMES	10
+
+/* Idle time before the chip is put in sleep mode */
+#define MCP2515_AUTOSUSPEND_MS		1000
+
+/* Period of the poll that rescues a stalled SPI engine */
+#define MCP2515_STALL_POLL_MS		1000
+
+/* Longest wait of the level interrupt thread for the SPI engine */
+#define MCP2515_IRQ_THREAD_TIMEOUT_MS	100
+
+/* Time without TX progress before the transmit buffers are aborted */
+#define MCP2515_TX_TIMEOUT		HZ
+
+/* Staging slot of a frame aborted for a more urgent one */
+#define MCP2515_TX_REQUEUED		MCP2515_TX_BUFS
+
+/* TXREQ polls before they are spaced by the yield time */
+#define MCP2515_TX_POLLS		8
+
+/* Transmit priority of a frame that preempted another one */
+#define MCP2515_TXP_PREEMPT		3
+
+/* Private flags, set with ethtool --set-priv-flags */
+#define MCP2515_PRIV_TX_PREEMPT		BIT(0)
+#define MCP2515_PRIV_ID_STATS		BIT(1)
+
+/*
+ * Raw frame as read from a receive buffer, queued for delivery.  One per
+ * cache line, so the SPI engine filling an entry and NAPI emptying the
+ * one before never share a line.
+ */
+struct mcp2515_rx_entry {
+	canid_t can_id;
+	u8 can_dlc;
+	u8 data[CAN_MAX_DLEN];
+	ktime_t tstamp;
+} ____cacheline_aligned;
+
+/* Frame to transmit, encoded for a transmit buffer */
+struct mcp2515_tx_frame {
+	struct sk_buff *skb;	/* frame, until its echo skb is set up */
+	struct sk_buff *echo_skb;	/* echo skb of an aborted frame */
+	u32 arb;		/* arbitration priority, lower wins */
+	unsigned int bytes;	/* data length of a cyclic frame */
+	u16 queue;		/* TX queue it came from */
+	u8 txp;			/* TXBnCTRL.TXP to send it with */
+	u8 len;			/* length of data */
+	u8 data[13];		/* TXBnSIDH to TXBnD7 */
+	bool cyclic;		/* from the cyclic TX engine, without skb */
+	u32 seq;		/* image of a cyclic entry, else 0 */
+	canid_t can_id;		/* of a cyclic frame, for the statistics */
+	bool used;
+};
+
+/*
+ * Driver statistics reported by ethtool -S.  The counters are kept per
+ * CPU, the gauges (last, highest and average values) in the device.
+ */
+struct mcp2515_xstats {
+	u64 rx_rxb0;		/* frames read from RXB0 */
+	u64 rx_rxb1;		/* frames read from RXB1, rolled over from RXB0 */
+	u64 rx_rollover;	/* flags reads with both receive buffers full */
+	u64 rx_alloc_failed;	/* frames dropped for lack of an skb */
+	u64 rx_sw_filtered;	/* frames dropped by the software filter */
+	u64 rx_unchanged;	/* frames dropped by the change filter */
+	u64 xdp_pass;		/* XDP verdicts */
+	u64 xdp_drop;
+	u64 xdp_redirect;
+	u64 xdp_aborted;	/* aborted, bad verdict or failed redirect */
+	u64 rx_ring_high_water;	/* highest fill level of the RX ring */
+	u64 rx_ring_overflow;	/* frames dropped because the RX ring was full */
+	u64 tx_preempted;	/* frames aborted and requeued for a more urgent one */
+	u64 tx_preempt_late;	/* aborts that came after the frame was sent */
+	u64 tx_abort_requests;	/* transmissions aborted, one or all buffers */
+	u64 spi_errors;		/* SPI transactions that failed to start */
+	u64 tx_timeout;		/* TX watchdog timeouts */
+	u64 tx_timeout_aborted;	/* frames aborted on TX watchdog timeouts */
+	u64 tx_timeout_completed;	/* frames found sent on TX watchdog timeouts */
+	u64 stall_rescued_busy;	/* SPI engine restarted after a failed submit */
+	u64 stall_rescued_idle;	/* SPI engine started for unserviced flags */
+	u64 runtime_suspends;	/* entries into sleep mode */
+	u64 bus_wakeups;	/* wakeups signalled by WAKIF */
+	u64 wake_latency_last_us;	/* wake event to normal mode, last */
+	u64 wake_latency_max_us;	/* wake event to normal mode, highest */
+	u64 mode_change_last_us;	/* CANCTRL write to CANSTAT match, last */
+	u64 mode_change_max_us;	/* CANCTRL write to CANSTAT match, highest */
+	u64 budget_exhausted;	/* service cycles cut short, engine yielded */
+	u64 rx_path_ns_avg;	/* receive buffer read completions, average */
+	u64 rx_path_ns_max;	/* receive buffer read completions, highest */
+	u64 tx_path_ns_avg;	/* ndo_start_xmit, average */
+	u64 tx_path_ns_max;	/* ndo_start_xmit, highest */
+	u64 spi_queued;		/* transactions queued behind other chips */
+	u64 spi_queued_overflow;	/* of which urgent for an RX overflow */
+	u64 spi_queue_wait_last_us;	/* time queued, last */
+	u64 spi_queue_wait_max_us;	/* time queued, highest */
+};
+
+/*
+ * Interface counters, per CPU: the SPI engine, NAPI and the transmit
+ * path update them without a lock.
+ */
+struct mcp2515_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 rx_dropped;
+	u64 rx_over_errors;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 tx_dropped;
+	u64 tx_aborted_errors;
+	struct mcp2515_xstats xstats;	/* counters only */
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Add VAL to the per-CPU counter FIELD.  Interrupts are disabled while
+ * the counter is written on 32-bit, as an SPI completion may interrupt
+ * NAPI on the same CPU.
+ */
+#define mcp2515_stats_add(priv, field, val)				\
+do {									\
+	struct mcp2515_pcpu_stats *__stats = get_cpu_ptr((priv)->stats); \
+	unsigned long __flags;						\
+									\
+	__flags = u64_stats_update_begin_irqsave(&__stats->syncp);	\
+	__stats->field += (val);					\
+	u64_stats_update_end_irqrestore(&__stats->syncp, __flags);	\
+	put_cpu_ptr((priv)->stats);					\
+} while (0)
+
+/* Traffic of one CAN ID */
+struct mcp2515_id_count {
+	u64 rx_frames;
+	u64 rx_bytes;
+	u64 tx_frames;
+	u64 tx_bytes;
+};
+
+struct mcp2515_eff_count {
+	u32 can_id;		/* with CAN_EFF_FLAG, 0 for a free slot */
+	struct mcp2515_id_count count;
+};
+
+/*
+ * Per CAN ID statistics, exported in debugfs: standard IDs index an
+ * array, extended IDs go to a hash table with linear probing.  Only the
+ * SPI engine updates them.
+ */
+struct mcp2515_id_stats {
+	struct u64_stats_sync syncp;
+	ktime_t start;		/* when counting started */
+	u64 eff_untracked;	/* frames of extended IDs not in eff */
+	struct mcp2515_id_count sff[CAN_SFF_MASK + 1];
+	struct mcp2515_eff_count eff[MCP2515_EFF_SLOTS];
+};
+
+/*
+ * Software receive filter, for ID sets the acceptance filters can't
+ * express: frames whose ID isn't in it are dropped by the SPI engine
+ * right after the header is read, before they take an skb.  Replaced
+ * as a whole under RCU.
+ */
+struct mcp2515_sw_filter {
+	struct rcu_head rcu;
+	DECLARE_BITMAP(sff, CAN_SFF_MASK + 1);	/* standard IDs */
+	bool eff_all;		/* accept all extended IDs */
+	unsigned int eff_count;
+	u32 eff[MCP2515_SW_FILTER_EFF_MAX];	/* extended IDs, sorted */
+};
+
+/*
+ * Change filter: frames of a configured ID whose payload, under a mask,
+ * is the same as the last delivered one are dropped, unless none was
+ * delivered for the timeout.  Remote frames have keys of their own, so
+ * they always pass and don't stand for the data frames of their ID.
+ * Replaced as a whole under RCU; the state is only touched by the SPI
+ * engine.
+ */
+struct mcp2515_rx_changed_entry {
+	canid_t can_id;		/* CAN_EFF_FLAG for an extended ID */
+	u8 mask[CAN_MAX_DLEN];	/* payload bits compared */
+	ktime_t timeout;	/* delivered at least this often, 0 never */
+
+	bool seen;		/* a frame was delivered: */
+	u8 dlc;
+	u8 data[CAN_MAX_DLEN];	/* its payload, masked */
+	ktime_t delivered;	/* and when */
+};
+
+struct mcp2515_rx_changed {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct mcp2515_rx_changed_entry entry[MCP2515_RX_CHANGED_MAX];
+};
+
+/*
+ * Cyclic TX engine: each entry has an hrtimer that loads its frame into
+ * the transmit buffer of its queue, from a prebuilt image of the buffer.
+ * A payload update swaps the image under RCU.  If the buffer is busy,
+ * the frame is due and takes the buffer as soon as it is free.
+ *
+ * One entry may reserve its transmit buffer: no other frame goes there,
+ * and as long as the buffer holds the image, a period only takes an RTS.
+ */
+struct mcp2515_cyclic_data {
+	struct rcu_head rcu;
+	u32 seq;		/* identifies the image, never 0 */
+	u32 arb;		/* arbitration priority */
+	u8 dlc;
+	u8 len;			/* length of data */
+	u8 data[13];		/* TXBnSIDH to TXBnD7 */
+};
+
+struct mcp2515_cyclic {
+	struct hrtimer timer;
+	struct net_device *dev;
+	struct mcp2515_cyclic_data __rcu *data;	/* NULL for a free entry */
+	canid_t can_id;
+	ktime_t period;
+	ktime_t phase;		/* first expiry after the engine starts */
+	u8 queue;		/* transmit buffer and TX queue */
+	bool reserve;		/* owns the transmit buffer */
+
+	/* Timer lateness, i.e. jitter of the frame release, timer only */
+	u64 sent;
+	u64 late_last_ns;
+	u64 late_avg_ns;	/* weight 1/8 */
+	u64 late_max_ns;
+	u64 overruns;		/* periods skipped, frame still due or late */
+	u64 rts_only;		/* frames sent from the image in the buffer */
+};
+
+/* A parsed tx_cyclic command */
+struct mcp2515_cyclic_cmd {
+	struct mcp2515_cyclic_data *data;	/* new image, NULL to remove */
+	canid_t can_id;
+	unsigned int period_us;	/* 0 to update the image of an entry */
+	unsigned int phase_us;
+	unsigned int queue;
+	bool reserve;
+	bool clear;		/* remove all entries */
+};
+
 /* Network device private data */
 struct mcp2515_priv {
 	struct can_priv can;	/* must be first for all CAN network devices */
 	struct spi_device *spi;	/* SPI device */
-	struct mcp251x_platform_data *pdata;
+	struct mcp251x_platform_data *pdata;	/* optional */
+	struct clk *clk;	/* optional oscillator clock */
+	struct regulator *power;	/* optional vdd supply */
+	struct regulator *transceiver;	/* optional xceiver supply */
+	bool transceiver_on;	/* transceiver supply enabled */
 
 	u8 canintf;		/* last read value of CANINTF register */
 	u8 eflg;		/* last read value of EFLG register */
 
-	struct sk_buff *skb;	/* skb to transmit or currently transmitting */
+	int rxb;		/* receive buffer being read */
+	struct can_frame rx_frame;	/* frame being read */
+	u64 rx_split_ns;	/* profiled header part of a split read */
+
+	ktime_t irq_tstamp;	/* first interrupt since last flags read */
+	ktime_t flags_tstamp;	/* when the flags read was started */
+	ktime_t tstamp;		/* estimated time of the events in canintf */
+	ktime_t tstamp_max;	/* when the flags read completed */
+	ktime_t tx_tstamp[MCP2515_TX_BUFS];	/* estimated end of transmission */
+	u8 tx_tstamped;		/* TXnIF bits for which tx_tstamp was taken */
+	struct hwtstamp_config hwts;	/* SIOCSHWTSTAMP, under RTNL */
+
+	u32 priv_flags;		/* MCP2515_PRIV_* */
+
+	int txb;		/* transmit buffer being loaded */
+	/* frame to transmit or currently transmitting per transmit buffer */
+	struct mcp2515_tx_frame tx_frame[MCP2515_TX_BUFS];
+	u8 txp[MCP2515_TX_BUFS];	/* current TXBnCTRL.TXP */
+
+	/*
+	 * In preemption mode frames are staged per queue, and the SPI engine
+	 * picks a transmit buffer for them, aborting a less urgent frame if
+	 * no buffer is free.  The aborted frame waits in a slot of its own,
+	 * so the queue of the urgent frame is free at once.
+	 */
+	struct mcp2515_tx_frame tx_staged[MCP2515_TX_BUFS + 1];
+	int tx_victim;		/* transmit buffer being aborted */
+	int tx_urgent;		/* staged frame to load into it */
+	unsigned int tx_polls;	/* TXREQ polls of the abort */
+	void (*yield_resume)(struct net_device *dev);	/* after a yield */
 
 	spinlock_t lock;	/* Lock for the following flags: */
 	unsigned busy:1;	/* set when pending async spi transaction */
 	unsigned interrupt:1;	/* set when pending interrupt handling */
-	unsigned transmit:1;	/* set when pending transmission */
+	unsigned irq_tstamp_valid:1;	/* set when irq_tstamp not consumed */
+	unsigned restage:1;	/* set when staged frames may be loadable */
+	unsigned tx_recover:1;	/* set when TX timeout recovery is pending */
+	struct completion idle;	/* completed when busy is cleared */
+
+	/*
+	 * Stall poll: restarts the engine when a transaction failed to be
+	 * submitted, or when it is idle with events pending.
+	 */
+	struct delayed_work stall_work;
+	bool spi_failed;	/* submitting the transaction failed */
+
+	/* Service cycle, against service_budget and service_budget_us */
+	unsigned int cycle_xfers;	/* transactions in the cycle */
+	ktime_t cycle_start;	/* first transaction of the cycle */
+	struct hrtimer yield_timer;	/* resumes the engine after a yield */
+
+	/*
+	 * Runtime PM: while the interface is up, each frame handed to the
+	 * driver holds a usage reference until it's sent, and receive
+	 * activity marks the device busy.  Once idle, the chip sleeps with
+	 * WAKIE set until bus activity or a frame to send wakes it.  A
+	 * sleeping chip loses the frames that wake it, so this is off until
+	 * enabled through power/control.
+	 */
+	bool pm_up;		/* interface up, runtime PM manages the chip */
+	unsigned asleep:1;	/* chip in sleep mode (under lock) */
+	u8 tx_pm_stopped;	/* queues stopped until wakeup (under lock) */
+	ktime_t wake_tstamp;	/* time of the wake event (under lock) */
+
+	/*
+	 * Write-through shadow of the configuration registers, see
+	 * mcp2515_reg_defaults.  Dirty registers differ from the chip.  The
+	 * SPI engine can't take the lock: the CANCTRL bits it sets on its
+	 * own are kept apart, and added to every write of CANCTRL.
+	 */
+	struct mutex reg_lock;	/* Lock for the register shadow */
+	u8 regs[MCP2515_NREGS];
+	DECLARE_BITMAP(regs_dirty, MCP2515_NREGS);
+	u8 ctrl_async;		/* CANCTRL bits set by the SPI engine */
+	int irq_mode;		/* MCP2515_IRQ_* requested */
+	struct mcp2515_irq_line *irq_line;	/* shared interrupt line */
+	struct list_head irq_node;	/* in irq_line->chips */
+	bool irq_kicked;	/* started by the dispatcher */
+	u8 transmit;		/* transmit buffers with pending transmission */
+	u8 rts;			/* loaded transmit buffers pending RTS */
+	u8 staged;		/* queues with a staged frame, requeued one */
 
 	/* Message, transfer and buffers for one async spi transaction */
 	struct spi_message message;
 	struct spi_transfer transfer;
-	u8 rx_buf[14] __attribute__((aligned(8)));
-	u8 tx_buf[14] __attribute__((aligned(8)));
+	void (*complete)(void *);	/* completion of current transaction */
+	u8 rx_buf[16] __attribute__((aligned(8)));
+	u8 tx_buf[16] __attribute__((aligned(8)));
+
+	/*
+	 * SPI cost model, fed by the duration of sampled async transactions.
+	 * Lengths are in 1/256 bytes, the received DLC in 1/16 bytes.
+	 */
+	ktime_t spi_start;	/* when the sampled transaction was submitted */
+	u32 spi_sample;		/* transactions since the last sample */
+	struct mcp2515_spi_bus *bus;	/* chips on the same SPI controller */
+	struct list_head bus_node;	/* in a bus queue, under bus->lock */
+	ktime_t bus_queued;	/* when the transaction was queued */
+	u32 short_len, short_ns;	/* averages of short transactions */
+	u32 long_len, long_ns;	/* averages of long transactions */
+	u32 rx_dlc;		/* average of received data lengths */
+
+	/*
+	 * RX ring: the SPI engine produces at rx_head, NAPI consumes at
+	 * rx_tail.  Both indices run freely, rx_ring_size is a power of 2.
+	 */
+	struct napi_struct napi;
+	struct mcp2515_rx_entry *rx_ring;
+	unsigned int rx_ring_size;
+	unsigned int rx_head ____cacheline_aligned;
+	unsigned int rx_tail ____cacheline_aligned;
+
+	struct mcp2515_pcpu_stats __percpu *stats;
+	struct mcp2515_id_stats *id_stats;	/* while up with ID_STATS */
+	struct dentry *debugfs;
+	struct mutex cfg_lock;	/* Lock for filter, cyclic and flag updates */
+	struct mcp2515_sw_filter __rcu *sw_filter;	/* NULL: accept all */
+	struct mcp2515_rx_changed __rcu *rx_changed;
+
+	struct mcp2515_cyclic cyclic[MCP2515_CYCLIC_MAX];	/* cfg_lock */
+	bool cyclic_running;	/* timers armed, under cfg_lock */
+	bool cyclic_pm;		/* holding a runtime PM reference */
+	u32 cyclic_due[MCP2515_TX_BUFS];	/* due entries, under lock */
+	u32 cyclic_seq;		/* last image, under cfg_lock */
+	s8 txb_reserved;	/* buffer of a cyclic entry or -1, under lock */
+	u32 txb_seq[MCP2515_TX_BUFS];	/* image in TXBn or 0 */
+	bool rx_drop;		/* frame in rx_frame is filtered out */
+
+	/*
+	 * XDP: NAPI runs the program on each frame as a struct can_frame,
+	 * before an skb is allocated.  A redirected frame takes the page.
+	 */
+	struct bpf_prog __rcu *xdp_prog;
+	struct xdp_rxq_info xdp_rxq;
+	struct page *xdp_page;	/* for the next frame, NAPI only */
+	/* Gauges of the driver statistics, writers serialized by the lock */
+	spinlock_t xstats_lock;
+	struct u64_stats_sync xstats_syncp;
+	struct mcp2515_xstats xstats;
 };
 
 static struct can_bittiming_const mcp2515_bittiming_const = {
@@ -177,27 +832,18 @@ static struct can_bittiming_const mcp2515_bittiming_const = {
  * SPI asynchronous completion callback functions.
  */
 static void mcp2515_read_flags_complete(void *context);
-static void mcp2515_read_rxb0_complete(void *context);
-static void mcp2515_read_rxb1_complete(void *context);
+static void mcp2515_read_rxb_complete(void *context);
+static void mcp2515_read_rxb_header_complete(void *context);
+static void mcp2515_read_rxb_data_complete(void *context);
 static void mcp2515_clear_canintf_complete(void *context);
 static void mcp2515_clear_eflg_complete(void *context);
-static void mcp2515_load_txb0_complete(void *context);
-static void mcp2515_rts_txb0_complete(void *context);
-
-/*
- * Write VALUE to register at address ADDR.
- * Synchronous.
- */
-static int mcp2515_write_reg(struct spi_device *spi, u8 reg, u8 val)
-{
-	const u8 buf[] __attribute__((aligned(8))) = {
-		[0] = MCP2515_INSTRUCTION_WRITE,
-		[1] = reg,	/* address */
-		[2] = val,	/* data */
-	};
-
-	return spi_write(spi, buf, sizeof(buf));
-}
+static void mcp2515_load_txb_complete(void *context);
+static void mcp2515_rts_txb_complete(void *context);
+static void mcp2515_abort_txb_complete(void *context);
+static void mcp2515_read_txbctrl_complete(void *context);
+static void mcp2515_abort_all_complete(void *context);
+static void mcp2515_read_status_complete(void *context);
+static void mcp2515_resume_tx_complete(void *context);
 
 /*
  * Read VALUE from register at address ADDR.
@@ -234,139 +880,441 @@ static int mcp2515_read_2regs(struct spi_device *spi, u8 reg, u8 *v1, u8 *v2)
 }
 
 /*
- * Reset internal registers to default state and enter configuration mode.
- * Synchronous.
+ * Registers kept in the shadow, with their values after reset.  Only
+ * registers the chip never changes by itself belong here.
  */
-static int mcp2515_hw_reset(struct spi_device *spi)
+static const struct {
+	u8 reg;
+	u8 val;
+} mcp2515_reg_defaults[] = {
+	{ CANCTRL, 0x87 },
+	{ CNF3, 0x00 },
+	{ CNF2, 0x00 },
+	{ CNF1, 0x00 },
+	{ CANINTE, 0x00 },
+	{ RXB0CTRL, 0x00 },
+	{ RXB1CTRL, 0x00 },
+};
+
+static bool mcp2515_reg_cached(u8 reg)
 {
-	const u8 cmd = MCP2515_INSTRUCTION_RESET;
+	int i;
 
-	return spi_write(spi, &cmd, sizeof(cmd));
-}
+	for (i = 0; i < ARRAY_SIZE(mcp2515_reg_defaults); i++)
+		if (mcp2515_reg_defaults[i].reg == reg)
+			return true;
 
-static int mcp2515_hw_sleep(struct spi_device *spi)
-{
-	return mcp2515_write_reg(spi, CANCTRL, CANCTRL_REQOP_SLEEP);
+	return false;
 }
 
-static void mcp2515_power_switch(const struct mcp2515_priv *priv, int on)
+/*
+ * Set a register in the shadow, to be written by mcp2515_reg_sync.
+ * Called with priv->reg_lock held.
+ */
+static void mcp2515_reg_set(struct mcp2515_priv *priv, u8 reg, u8 val)
 {
- /*
+	lockdep_assert_held(&priv->reg_lock);
 
-	if (priv->pdata->power_enable)
-		priv->pdata->power_enable(on);
-	else if (!on)
-		mcp2515_hw_sleep(priv->spi);
-*/
+	if (priv->regs[reg] == val)
+		return;
+
+	priv->regs[reg] = val;
+	__set_bit(reg, priv->regs_dirty);
 }
 
-static void mcp2515_transceiver_switch(const struct mcp2515_priv *priv, int on)
-{
 /*
+ * Write the dirty registers, in one WRITE per run of consecutive
+ * registers.  A run may span a few clean cached registers, rewriting
+ * their value, when that is cheaper than starting another WRITE.
+ * Called with priv->reg_lock held.
+ * Synchronous.
+ */
+static int mcp2515_reg_sync(struct mcp2515_priv *priv)
+{
+	u8 buf[2 + MCP2515_NREGS] __attribute__((aligned(8)));
+	int reg, last, r, err;
+	u8 ctrl;
+
+	lockdep_assert_held(&priv->reg_lock);
+
+	for_each_set_bit(reg, priv->regs_dirty, MCP2515_NREGS) {
+		last = reg;
+		for (r = reg + 1; r < MCP2515_NREGS &&
+			     r - last <= MCP2515_REG_GAP + 1; r++) {
+			if (test_bit(r, priv->regs_dirty))
+				last = r;
+			else if (!mcp2515_reg_cached(r))
+				break;
+		}
 
-	if (priv->pdata->transceiver_enable)
-		priv->pdata->transceiver_enable(on);
-*/
-}
+		/* Written again if the SPI engine changed CANCTRL meanwhile */
+		do {
+			ctrl = READ_ONCE(priv->ctrl_async);
+			buf[0] = MCP2515_INSTRUCTION_WRITE;
+			buf[1] = reg;
+			memcpy(buf + 2, &priv->regs[reg], last - reg + 1);
+			if (reg <= CANCTRL && CANCTRL <= last)
+				buf[2 + CANCTRL - reg] |= ctrl;
+			err = spi_write(priv->spi, buf, last - reg + 3);
+			if (err)
+				return err;
+		} while (reg <= CANCTRL && CANCTRL <= last &&
+			 ctrl != READ_ONCE(priv->ctrl_async));
+
+		bitmap_clear(priv->regs_dirty, reg, last - reg + 1);
+	}
 
-static void mcp2515_board_specific_setup(const struct mcp2515_priv *priv)
-{
-/*	if (priv->pdata->board_specific_setup)
-		priv->pdata->board_specific_setup(priv->spi);
-*/
+	return 0;
 }
 
 /*
- * Set the bit timing configuration registers, the interrupt enable register
- * and the receive buffers control registers.
+ * Write a register, unless it already has that value.
  * Synchronous.
  */
-static int mcp2515_chip_start(struct net_device *dev)
+static int mcp2515_reg_write(struct mcp2515_priv *priv, u8 reg, u8 val)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct spi_device *spi = priv->spi;
-	struct can_bittiming *bt = &priv->can.bittiming;
-	unsigned long timeout;
-	u8 *buf = (u8 *)priv->transfer.tx_buf;
-	u8 mode;
 	int err;
 
-	err = mcp2515_hw_reset(spi);
-	if (err)
-		return err;
+	mutex_lock(&priv->reg_lock);
+	mcp2515_reg_set(priv, reg, val);
+	err = mcp2515_reg_sync(priv);
+	mutex_unlock(&priv->reg_lock);
 
-	/* set bittiming */
-	buf[0] = MCP2515_INSTRUCTION_WRITE;
-	buf[1] = CNF3;
+	return err;
+}
 
-	/* CNF3 */
-	buf[2] = bt->phase_seg2 - 1;
+/*
+ * Set the bits of MASK in a register to VAL, without reading it.
+ * Synchronous.
+ */
+static int mcp2515_reg_update(struct mcp2515_priv *priv, u8 reg, u8 mask,
+			      u8 val)
+{
+	int err;
 
-	/* CNF2 */
-	buf[3] = CNF2_BTLMODE |
-		(priv->can.ctrlmode & CAN_CTRLMODE_3_SAMPLES ? CNF2_SAM : 0x0) |
-		(bt->phase_seg1 - 1) << 3 | (bt->prop_seg - 1);
+	mutex_lock(&priv->reg_lock);
+	mcp2515_reg_set(priv, reg, (priv->regs[reg] & ~mask) | (val & mask));
+	err = mcp2515_reg_sync(priv);
+	mutex_unlock(&priv->reg_lock);
 
-	/* CNF1 */
-	buf[4] = (bt->sjw - 1) << 6 | (bt->brp - 1);
+	return err;
+}
 
-	/* CANINTE */
-	buf[5] = CANINTE_RX | CANINTE_TX | CANINTE_ERR;
+/*
+ * The chip was reset: the shadow keeps the configuration, which is dirty
+ * where it differs from the reset values, to be restored by the next
+ * mcp2515_reg_sync.  CANCTRL is not restored, the operation mode is only
+ * requested once the configuration is written.
+ * Called with priv->reg_lock held.
+ */
+static void mcp2515_reg_reset(struct mcp2515_priv *priv)
+{
+	int i;
 
-	netdev_info(dev, "writing CNF: 0x%02x 0x%02x 0x%02x\n",
-		    buf[4], buf[3], buf[2]);
-	err = spi_write(spi, buf, 6);
-	if (err)
-		return err;
+	for (i = 0; i < ARRAY_SIZE(mcp2515_reg_defaults); i++) {
+		u8 reg = mcp2515_reg_defaults[i].reg;
+		u8 val = mcp2515_reg_defaults[i].val;
 
-	/* config RX buffers */
-	/* buf[0] = MCP2515_INSTRUCTION_WRITE; already set */
-	buf[1] = RXB0CTRL;
+		if (reg == CANCTRL) {
+			priv->regs[reg] = val;
+			WRITE_ONCE(priv->ctrl_async, 0);
+		}
 
-	/* RXB0CTRL */
-	buf[2] = RXBCTRL_RXM1 | RXBCTRL_RXM0 | RXBCTRL_BUKT;
+		if (priv->regs[reg] == val)
+			__clear_bit(reg, priv->regs_dirty);
+		else
+			__set_bit(reg, priv->regs_dirty);
+	}
+}
 
-	/* RXB1CTRL */
-	buf[3] = RXBCTRL_RXM1 | RXBCTRL_RXM0;
+/*
+ * Reset internal registers to default state and enter configuration mode.
+ * Synchronous.
+ */
+static int mcp2515_hw_reset(struct mcp2515_priv *priv)
+{
+	const u8 cmd = MCP2515_INSTRUCTION_RESET;
+	int err;
 
-	err = spi_write(spi, buf, 4);
-	if (err)
-		return err;
+	mutex_lock(&priv->reg_lock);
+	err = spi_write(priv->spi, &cmd, sizeof(cmd));
+	if (!err)
+		mcp2515_reg_reset(priv);
+	mutex_unlock(&priv->reg_lock);
 
-	/* handle can.ctrlmode */
-	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
-		mode = CANCTRL_REQOP_LOOPBACK;
-	else if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
-		mode = CANCTRL_REQOP_LISTEN_ONLY;
-	else
-		mode = CANCTRL_REQOP_NORMAL;
+	return err;
+}
 
-	if (mode & CAN_CTRLMODE_ONE_SHOT)
-		mode |= CANCTRL_OSM;
+/*
+ * Set the bits of MASK in register REG to VAL.
+ * Synchronous.
+ */
+static int mcp2515_bit_modify(struct spi_device *spi, u8 reg, u8 mask, u8 val)
+{
+	const u8 buf[] __attribute__((aligned(8))) = {
+		[0] = MCP2515_INSTRUCTION_BIT_MODIFY,
+		[1] = reg,	/* address */
+		[2] = mask,
+		[3] = val,	/* data */
+	};
 
-	/* Put device into requested mode */
-	mcp2515_transceiver_switch(priv, 1);
-	mcp2515_write_reg(spi, CANCTRL, mode);
+	return spi_write(spi, buf, sizeof(buf));
+}
 
-	/* Wait for the device to enter requested mode */
-	timeout = jiffies + HZ;
-	do {
-		u8 reg_stat;
+/*
+ * Set a gauge of the driver statistics: LAST, if any, to VAL, and MAX to
+ * the highest value seen.
+ */
+static void mcp2515_gauge(struct mcp2515_priv *priv, u64 *last, u64 *max,
+			  u64 val)
+{
+	unsigned long flags;
 
-		err = mcp2515_read_reg(spi, CANSTAT, &reg_stat);
+	spin_lock_irqsave(&priv->xstats_lock, flags);
+	u64_stats_update_begin(&priv->xstats_syncp);
+	if (last)
+		*last = val;
+	if (val > *max)
+		*max = val;
+	u64_stats_update_end(&priv->xstats_syncp);
+	spin_unlock_irqrestore(&priv->xstats_lock, flags);
+}
+
+/*
+ * Worst case time of a mode change, from the bitrate and clock.
+ */
+static u32 mcp2515_mode_change_us(const struct mcp2515_priv *priv)
+{
+	u32 bitrate = max_t(u32, priv->can.bittiming.bitrate, 10000);
+	u32 osc_khz = max_t(u32, priv->can.clock.freq / 500, 1);
+
+	return DIV_ROUND_UP(MCP2515_MODE_MAX_BITS * USEC_PER_SEC, bitrate) +
+		DIV_ROUND_UP(MCP2515_MODE_OST_CYCLES * USEC_PER_MSEC, osc_khz);
+}
+
+/*
+ * Wait for the device to enter the operation mode requested in CANCTRL.
+ * It's checked at once, as the change is immediate on an idle bus, then
+ * with exponentially growing sleeps, giving up after several times the
+ * worst case.  The time it took is accounted in the statistics.
+ * Synchronous.
+ */
+static int mcp2515_wait_for_mode(struct mcp2515_priv *priv, u8 mode)
+{
+	struct spi_device *spi = priv->spi;
+	u32 timeout_us = max_t(u32, MCP2515_MODE_TIMEOUT_FRAMES *
+			       mcp2515_mode_change_us(priv),
+			       MCP2515_MODE_TIMEOUT_MIN_US);
+	u32 delay_us = MCP2515_MODE_POLL_MIN_US;
+	ktime_t start = ktime_get();
+	u8 reg_stat;
+	s64 us;
+	int err;
+
+	for (;;) {
+		err = mcp2515_read_reg(spi, CANSTAT, &reg_stat);
 		if (err)
-			goto failed_request;
-		else if ((reg_stat & CANCTRL_REQOP_MASK) == mode)
+			return err;
+
+		us = ktime_us_delta(ktime_get(), start);
+		if ((reg_stat & CANCTRL_REQOP_MASK) ==
+		    (mode & CANCTRL_REQOP_MASK))
 			break;
 
-		schedule();
-		if (time_after(jiffies, timeout)) {
+		if (us > timeout_us) {
 			dev_err(&spi->dev,
 				"MCP2515 didn't enter in requested mode\n");
-			err = -EBUSY;
-			goto failed_request;
+			return -EBUSY;
+		}
+
+		usleep_range(delay_us, 2 * delay_us);
+		delay_us = min_t(u32, 2 * delay_us, MCP2515_MODE_POLL_MAX_US);
+	}
+
+	mcp2515_gauge(priv, &priv->xstats.mode_change_last_us,
+		      &priv->xstats.mode_change_max_us, us);
+
+	return 0;
+}
+
+static int mcp2515_hw_sleep(struct mcp2515_priv *priv)
+{
+	return mcp2515_reg_write(priv, CANCTRL, CANCTRL_REQOP_SLEEP);
+}
+
+/*
+ * Switch the vdd supply, if any; without one the chip is put in sleep
+ * mode when switched off.
+ */
+static void mcp2515_power_switch(struct mcp2515_priv *priv, int on)
+{
+	int err;
+
+	if (!priv->power) {
+		if (!on)
+			mcp2515_hw_sleep(priv);
+		return;
+	}
+
+	if (on) {
+		err = regulator_enable(priv->power);
+		if (err)
+			dev_err(&priv->spi->dev, "vdd enable failed, err=%d\n",
+				err);
+	} else {
+		regulator_disable(priv->power);
+	}
+}
+
+/*
+ * Switch the transceiver supply, if any.  Calls may repeat, e.g. on a
+ * restart after bus-off, so the regulator is only switched on changes.
+ */
+static void mcp2515_transceiver_switch(struct mcp2515_priv *priv, int on)
+{
+	int err;
+
+	if (!priv->transceiver || priv->transceiver_on == !!on)
+		return;
+
+	if (on) {
+		err = regulator_enable(priv->transceiver);
+		if (err) {
+			dev_err(&priv->spi->dev,
+				"xceiver enable failed, err=%d\n", err);
+			return;
 		}
-	} while (1);
+	} else {
+		regulator_disable(priv->transceiver);
+	}
+	priv->transceiver_on = on;
+}
+
+static void mcp2515_board_specific_setup(const struct mcp2515_priv *priv)
+{
+/*	if (priv->pdata->board_specific_setup)
+		priv->pdata->board_specific_setup(priv->spi);
+*/
+}
+
+/*
+ * Operation mode for can.ctrlmode.
+ */
+static u8 mcp2515_ctrl_mode(const struct mcp2515_priv *priv)
+{
+	u8 mode;
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
+		mode = CANCTRL_REQOP_LOOPBACK;
+	else if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
+		mode = CANCTRL_REQOP_LISTEN_ONLY;
+	else
+		mode = CANCTRL_REQOP_NORMAL;
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT)
+		mode |= CANCTRL_OSM;
+
+	return mode;
+}
+
+/*
+ * Drop the runtime PM reference held by a frame.
+ */
+static void mcp2515_pm_put(const struct mcp2515_priv *priv)
+{
+	pm_runtime_mark_last_busy(&priv->spi->dev);
+	pm_runtime_put_autosuspend(&priv->spi->dev);
+}
+
+/*
+ * Forget the frames in the transmit buffers, on a chip reset or when the
+ * interface goes down; their echo skbs are freed by the CAN core.
+ */
+static void mcp2515_drop_tx_frames(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int n;
+
+	for (n = 0; n < MCP2515_TX_BUFS; n++) {
+		struct mcp2515_tx_frame *frame = &priv->tx_frame[n];
+
+		if (!frame->used)
+			continue;
+
+		if (frame->skb)
+			dev_kfree_skb_any(frame->skb);
+		frame->skb = NULL;
+		frame->used = false;
+		mcp2515_pm_put(priv);
+	}
+}
+
+/*
+ * Set the bit timing configuration registers, the interrupt enable register
+ * and the receive buffers control registers.
+ * Synchronous.
+ */
+static int mcp2515_chip_start(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct can_bittiming *bt = &priv->can.bittiming;
+	unsigned long flags;
+	u8 mode;
+	int err, n;
+
+	err = mcp2515_hw_reset(priv);
+	if (err)
+		return err;
+
+	mutex_lock(&priv->reg_lock);
+
+	/* set bittiming */
+	mcp2515_reg_set(priv, CNF3, bt->phase_seg2 - 1);
+	mcp2515_reg_set(priv, CNF2, CNF2_BTLMODE |
+		(priv->can.ctrlmode & CAN_CTRLMODE_3_SAMPLES ? CNF2_SAM : 0x0) |
+		(bt->phase_seg1 - 1) << 3 | (bt->prop_seg - 1));
+	mcp2515_reg_set(priv, CNF1, (bt->sjw - 1) << 6 | (bt->brp - 1));
+	mcp2515_reg_set(priv, CANINTE, CANINTE_RX | CANINTE_TX | CANINTE_ERR);
+
+	netdev_info(dev, "writing CNF: 0x%02x 0x%02x 0x%02x\n",
+		    priv->regs[CNF1], priv->regs[CNF2], priv->regs[CNF3]);
+
+	/* config RX buffers, 16 registers apart: two WRITEs */
+	mcp2515_reg_set(priv, RXB0CTRL,
+			RXBCTRL_RXM1 | RXBCTRL_RXM0 | RXBCTRL_BUKT);
+	mcp2515_reg_set(priv, RXB1CTRL, RXBCTRL_RXM1 | RXBCTRL_RXM0);
+
+	err = mcp2515_reg_sync(priv);
+	mutex_unlock(&priv->reg_lock);
+	if (err)
+		return err;
+
+	/*
+	 * TXBnCTRL.TXP is 0 after reset; mcp2515_load_txb writes the
+	 * priority of the queue along with the first frame of a buffer.
+	 */
+	for (n = 0; n < MCP2515_TX_BUFS; n++) {
+		priv->txp[n] = 0;
+		priv->txb_seq[n] = 0;
+	}
+	/* Nothing pending may refer to a dropped frame */
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->transmit = 0;
+	priv->rts = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+	mcp2515_drop_tx_frames(dev);
+	priv->tx_tstamped = 0;
+	if (priv->staged)
+		priv->restage = 1;
+
+	/* Put device into requested mode */
+	mode = mcp2515_ctrl_mode(priv);
+	mcp2515_transceiver_switch(priv, 1);
+	mcp2515_reg_write(priv, CANCTRL, mode);
+
+	err = mcp2515_wait_for_mode(priv, mode);
+	if (err)
+		goto failed_request;
 
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
@@ -381,9 +1329,8 @@ static int mcp2515_chip_start(struct net_device *dev)
 static void mcp2515_chip_stop(struct net_device *dev)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct spi_device *spi = priv->spi;
 
-	mcp2515_hw_reset(spi);
+	mcp2515_hw_reset(priv);
 	mcp2515_transceiver_switch(priv, 0);
 	priv->can.state = CAN_STATE_STOPPED;
 
@@ -391,16 +1338,200 @@ static void mcp2515_chip_stop(struct net_device *dev)
 }
 
 /*
- * Start an asynchronous SPI transaction.
+ * Join the chips on the SPI controller of this one.
  */
-static void mcp2515_spi_async(struct net_device *dev)
+static int mcp2515_spi_bus_get(struct mcp2515_priv *priv)
+{
+	struct spi_controller *ctlr = priv->spi->controller;
+	struct mcp2515_spi_bus *bus;
+	int i, err = 0;
+
+	mutex_lock(&mcp2515_spi_buses_lock);
+
+	list_for_each_entry(bus, &mcp2515_spi_buses, node)
+		if (bus->ctlr == ctlr)
+			goto found;
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		err = -ENOMEM;
+		goto out;
+	}
+	bus->ctlr = ctlr;
+	spin_lock_init(&bus->lock);
+	for (i = 0; i < MCP2515_URGENCY_LEVELS; i++)
+		INIT_LIST_HEAD(&bus->queue[i]);
+	list_add(&bus->node, &mcp2515_spi_buses);
+
+ found:
+	bus->users++;
+	priv->bus = bus;
+	INIT_LIST_HEAD(&priv->bus_node);
+ out:
+	mutex_unlock(&mcp2515_spi_buses_lock);
+
+	return err;
+}
+
+static void mcp2515_spi_bus_put(struct mcp2515_priv *priv)
+{
+	struct mcp2515_spi_bus *bus = priv->bus;
+
+	mutex_lock(&mcp2515_spi_buses_lock);
+	if (!--bus->users) {
+		list_del(&bus->node);
+		kfree(bus);
+	}
+	mutex_unlock(&mcp2515_spi_buses_lock);
+
+	priv->bus = NULL;
+}
+
+/*
+ * Urgency of the transaction set up in priv->transfer.
+ */
+static int mcp2515_spi_urgency(const struct mcp2515_priv *priv)
+{
+	if (priv->complete == mcp2515_read_rxb_complete ||
+	    priv->complete == mcp2515_read_rxb_header_complete ||
+	    priv->complete == mcp2515_read_rxb_data_complete) {
+		if ((priv->canintf & CANINTF_RX) == CANINTF_RX)
+			return MCP2515_URGENCY_OVERFLOW;
+		return MCP2515_URGENCY_RX;
+	}
+
+	if (priv->complete == mcp2515_read_flags_complete)
+		return MCP2515_URGENCY_RX;
+
+	return MCP2515_URGENCY_LOW;
+}
+
+static void mcp2515_spi_bus_release(struct mcp2515_spi_bus *bus);
+
+/*
+ * Hand the transaction of a chip to the SPI controller.
+ */
+static void mcp2515_spi_submit(struct net_device *dev)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
 	int err;
 
+	if (rx_read_mode == MCP2515_RX_READ_AUTO &&
+	    ++priv->spi_sample >= MCP2515_SPI_COST_SAMPLE) {
+		priv->spi_sample = 0;
+		priv->spi_start = ktime_get();
+	}
+
 	err = spi_async(priv->spi, &priv->message);
-	if (err)
+	if (err) {
+		WRITE_ONCE(priv->spi_failed, true);
+		mcp2515_stats_add(priv, xstats.spi_errors, 1);
 		netdev_err(dev, "%s failed with err=%d\n", __func__, err);
+		mcp2515_spi_bus_release(priv->bus);
+	}
+}
+
+/*
+ * A submitted transaction completed: submit the most urgent queued one in
+ * its place, accounting how long it waited.
+ */
+static void mcp2515_spi_bus_release(struct mcp2515_spi_bus *bus)
+{
+	struct mcp2515_priv *next = NULL;
+	unsigned long flags;
+	s64 us;
+	int i;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	for (i = MCP2515_URGENCY_LEVELS - 1; i >= 0; i--) {
+		next = list_first_entry_or_null(&bus->queue[i],
+						struct mcp2515_priv, bus_node);
+		if (next) {
+			list_del_init(&next->bus_node);
+			break;
+		}
+	}
+	if (!next)
+		bus->inflight--;
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	if (!next)
+		return;
+
+	us = ktime_us_delta(ktime_get(), next->bus_queued);
+	mcp2515_gauge(next, &next->xstats.spi_queue_wait_last_us,
+		      &next->xstats.spi_queue_wait_max_us, us);
+
+	mcp2515_spi_submit(dev_get_drvdata(&next->spi->dev));
+}
+
+/*
+ * Start an asynchronous SPI transaction, or queue it by urgency while
+ * the other chips on the SPI controller have enough in flight.
+ */
+static void mcp2515_spi_async(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_spi_bus *bus = priv->bus;
+	unsigned long flags;
+	int urgency;
+
+	if (static_branch_unlikely(&mcp2515_budget_key) &&
+	    !priv->cycle_xfers++)
+		priv->cycle_start = ktime_get();
+
+	spin_lock_irqsave(&bus->lock, flags);
+	if (bus->inflight < MCP2515_BUS_INFLIGHT) {
+		bus->inflight++;
+		spin_unlock_irqrestore(&bus->lock, flags);
+		mcp2515_spi_submit(dev);
+		return;
+	}
+
+	urgency = mcp2515_spi_urgency(priv);
+	priv->bus_queued = ktime_get();
+	list_add_tail(&priv->bus_node, &bus->queue[urgency]);
+	mcp2515_stats_add(priv, xstats.spi_queued, 1);
+	if (urgency == MCP2515_URGENCY_OVERFLOW)
+		mcp2515_stats_add(priv, xstats.spi_queued_overflow, 1);
+	spin_unlock_irqrestore(&bus->lock, flags);
+}
+
+/*
+ * Give up the SPI bus for the yield time, then go on with RESUME.
+ */
+static void mcp2515_yield(struct mcp2515_priv *priv,
+			  void (*resume)(struct net_device *dev))
+{
+	priv->yield_resume = resume;
+	hrtimer_start(&priv->yield_timer,
+		      us_to_ktime(READ_ONCE(service_yield_us)),
+		      HRTIMER_MODE_REL);
+}
+
+/*
+ * Tell whether the service cycle spent its budget, and if so end it and
+ * have the yield timer resume the engine with RESUME.
+ */
+static bool mcp2515_service_yield(struct mcp2515_priv *priv,
+				  void (*resume)(struct net_device *dev))
+{
+	unsigned int budget = READ_ONCE(service_budget);
+	unsigned int budget_us = READ_ONCE(service_budget_us);
+
+	if (!priv->cycle_xfers)
+		return false;
+
+	if (!(budget && priv->cycle_xfers >= budget) &&
+	    !(budget_us && ktime_us_delta(ktime_get(), priv->cycle_start) >=
+	      budget_us))
+		return false;
+
+	priv->cycle_xfers = 0;
+	mcp2515_stats_add(priv, xstats.budget_exhausted, 1);
+	mcp2515_yield(priv, resume);
+
+	return true;
 }
 
 /*
@@ -412,52 +1543,154 @@ static void mcp2515_read_flags(struct net_device *dev)
 	struct mcp2515_priv *priv = netdev_priv(dev);
 	u8 *buf = (u8 *)priv->transfer.tx_buf;
 
+	if (static_branch_unlikely(&mcp2515_budget_key) &&
+	    mcp2515_service_yield(priv, mcp2515_read_flags))
+		return;
+
 	buf[0] = MCP2515_INSTRUCTION_READ;
 	buf[1] = CANINTF;
 	buf[2] = 0;	/* CANINTF */
 	buf[3] = 0;	/* EFLG */
 	priv->transfer.len = 4;
-	priv->message.complete = mcp2515_read_flags_complete;
+	priv->complete = mcp2515_read_flags_complete;
+	if (static_branch_unlikely(&mcp2515_hwtstamp_key))
+		priv->flags_tstamp = ktime_get_real();
 
 	mcp2515_spi_async(dev);
 }
 
 /*
- * Read receive buffer 0 (instruction 0x90) or 1 (instruction 0x94).
- * Asynchronous.
+ * Fold a new sample into a running average (weight 1/8).
  */
-static void mcp2515_read_rxb(struct net_device *dev, u8 instruction,
-			     void (*complete)(void *))
+static void mcp2515_ewma(u32 *avg, u32 sample)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-	u8 *buf = (u8 *)priv->transfer.tx_buf;
+	if (*avg)
+		*avg = *avg - (*avg >> 3) + (sample >> 3);
+	else
+		*avg = sample;
+}
 
-	memset(buf, 0, 14);
-	buf[0] = instruction;
-	priv->transfer.len = 14; /* instruction + id(4) + dlc + data(8) */
-	priv->message.complete = complete;
+/*
+ * Account a hot path run started at START (ns) in its average (weight
+ * 1/8) and highest durations.
+ */
+static void mcp2515_profile(struct mcp2515_priv *priv, u64 *avg, u64 *max,
+			    u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	unsigned long flags;
 
-	mcp2515_spi_async(dev);
+	spin_lock_irqsave(&priv->xstats_lock, flags);
+	u64_stats_update_begin(&priv->xstats_syncp);
+	*avg = *avg ? *avg - (*avg >> 3) + (ns >> 3) : ns;
+	if (ns > *max)
+		*max = ns;
+	u64_stats_update_end(&priv->xstats_syncp);
+	spin_unlock_irqrestore(&priv->xstats_lock, flags);
+}
+
+/*
+ * Account the duration of the transaction that just completed, if it
+ * was sampled.
+ */
+static void mcp2515_spi_cost_update(struct mcp2515_priv *priv)
+{
+	unsigned len = priv->transfer.len;
+	s64 ns;
+
+	if (!priv->spi_start)
+		return;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), priv->spi_start));
+	priv->spi_start = 0;
+
+	if (ns <= 0 || ns > MCP2515_SPI_COST_MAX_NS)
+		return;
+
+	if (len <= 4) {
+		mcp2515_ewma(&priv->short_len, len << 8);
+		mcp2515_ewma(&priv->short_ns, ns);
+	} else if (len >= MCP2515_SPI_COST_LONG) {
+		mcp2515_ewma(&priv->long_len, len << 8);
+		mcp2515_ewma(&priv->long_ns, ns);
+	}
+}
+
+/*
+ * Decide whether to read a receive buffer in two transactions: the header
+ * with a READ (which leaves RXnIF set, so the buffer can't be overwritten),
+ * then DLC data bytes with a READ RX BUFFER (which clears RXnIF).  That is
+ * 8 + DLC bytes instead of 14, at the price of a second transaction setup,
+ * so it only pays if setup < (6 - DLC) * per-byte cost.
+ */
+static bool mcp2515_rx_split(const struct mcp2515_priv *priv)
+{
+	s64 byte_ns, setup_ns;
+	s32 dlen;
+
+	if (rx_read_mode != MCP2515_RX_READ_AUTO)
+		return rx_read_mode == MCP2515_RX_READ_SPLIT;
+
+	/* Not calibrated yet: the full read is never much worse */
+	dlen = (s32)priv->long_len - (s32)priv->short_len;
+	if (!priv->short_len || !priv->long_len || dlen < (4 << 8))
+		return false;
+
+	/* per-byte cost in 1/256 ns, setup cost in ns */
+	byte_ns = div_s64(((s64)priv->long_ns - priv->short_ns) << 16, dlen);
+	if (byte_ns <= 0)
+		return false;
+	setup_ns = priv->short_ns - ((byte_ns * priv->short_len) >> 16);
+
+	return setup_ns * 16 * 256 < (6 * 16 - (s64)priv->rx_dlc) * byte_ns;
 }
 
 /*
- * Read receive buffer 0.
+ * Read receive buffer N, either in one shot or header first.
  * Asynchronous.
  */
-static void mcp2515_read_rxb0(struct net_device *dev)
+static void mcp2515_read_rxb(struct net_device *dev, int n)
 {
-	mcp2515_read_rxb(dev, MCP2515_INSTRUCTION_READ_RXB(0),
-			 mcp2515_read_rxb0_complete);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	priv->rxb = n;
+	memset(buf, 0, 14);
+
+	if (mcp2515_rx_split(priv)) {
+		buf[0] = MCP2515_INSTRUCTION_READ;
+		buf[1] = RXBSIDH(n);
+		priv->transfer.len = 7; /* instruction + address + id(4) + dlc */
+		priv->complete = mcp2515_read_rxb_header_complete;
+	} else {
+		buf[0] = MCP2515_INSTRUCTION_READ_RXB(n);
+		priv->transfer.len = 14; /* instruction + id(4) + dlc + data(8) */
+		priv->complete = mcp2515_read_rxb_complete;
+	}
+
+	mcp2515_spi_async(dev);
 }
 
 /*
- * Read receive buffer 1.
+ * Read the data bytes of the receive buffer whose header is in rx_frame,
+ * releasing the buffer.  RTR, zero length and filtered out frames just
+ * release it.
  * Asynchronous.
  */
-static void mcp2515_read_rxb1(struct net_device *dev)
+static void mcp2515_read_rxb_data(struct net_device *dev)
 {
-	mcp2515_read_rxb(dev, MCP2515_INSTRUCTION_READ_RXB(1),
-			 mcp2515_read_rxb1_complete);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct can_frame *frame = &priv->rx_frame;
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	memset(buf, 0, 9);
+	buf[0] = MCP2515_INSTRUCTION_READ_RXB_DATA(priv->rxb);
+	priv->transfer.len = 1;
+	if (!(frame->can_id & CAN_RTR_FLAG) && !priv->rx_drop)
+		priv->transfer.len += frame->can_dlc;
+	priv->complete = mcp2515_read_rxb_data_complete;
+
+	mcp2515_spi_async(dev);
 }
 
 /*
@@ -474,7 +1707,7 @@ static void mcp2515_clear_canintf(struct net_device *dev)
 	buf[2] = priv->canintf & ~(CANINTF_RX0IF | CANINTF_RX1IF); /* mask */
 	buf[3] = 0;	/* data */
 	priv->transfer.len = 4;
-	priv->message.complete = mcp2515_clear_canintf_complete;
+	priv->complete = mcp2515_clear_canintf_complete;
 
 	mcp2515_spi_async(dev);
 }
@@ -493,18 +1726,16 @@ static void mcp2515_clear_eflg(struct net_device *dev)
 	buf[2] = priv->eflg;	/* mask */
 	buf[3] = 0;		/* data */
 	priv->transfer.len = 4;
-	priv->message.complete = mcp2515_clear_eflg_complete;
+	priv->complete = mcp2515_clear_eflg_complete;
 
 	mcp2515_spi_async(dev);
 }
 
 /*
- * Set the transmit buffer, starting at TXB0SIDH, for an skb.
+ * Set the transmit buffer, starting at TXB0SIDH, for a frame.
  */
-static int mcp2515_set_txbuf(u8 *buf, const struct sk_buff *skb)
+static int mcp2515_set_txbuf(u8 *buf, const struct can_frame *frame)
 {
-	struct can_frame *frame = (struct can_frame *)skb->data;
-
 	if (frame->can_id & CAN_EFF_FLAG) {
 		buf[0] = frame->can_id >> 21;
 		buf[1] = (frame->can_id >> 13 & 0xe0) | 8 |
@@ -528,424 +1759,3617 @@ static int mcp2515_set_txbuf(u8 *buf, const struct sk_buff *skb)
 }
 
 /*
- * Send the "load transmit buffer 0" SPI message.
- * Asynchronous.
+ * Arbitration priority of a CAN identifier: the bits of the arbitration
+ * field as they go on the bus, so that a lower value wins.
  */
-static void mcp2515_load_txb0(struct sk_buff *skb, struct net_device *dev)
+static u32 mcp2515_arb_key(canid_t id)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-	u8 *buf = (u8 *)priv->transfer.tx_buf;
+	u32 rtr = !!(id & CAN_RTR_FLAG);
 
-	buf[0] = MCP2515_INSTRUCTION_LOAD_TXB(0);
-	priv->transfer.len = mcp2515_set_txbuf(buf + 1, skb) + 1;
-	priv->message.complete = mcp2515_load_txb0_complete;
+	if (id & CAN_EFF_FLAG)
+		return (id & CAN_EFF_MASK) >> 18 << 21 | 3 << 19 |
+			(id & 0x3ffff) << 1 | rtr;
 
-	can_put_echo_skb(skb, dev, 0);
-
-	mcp2515_spi_async(dev);
+	return (id & CAN_SFF_MASK) << 21 | rtr << 20;
+}
+
+static void mcp2515_tx_frame_init(struct mcp2515_tx_frame *frame,
+				  struct sk_buff *skb, int queue)
+{
+	const struct can_frame *cf = (struct can_frame *)skb->data;
+
+	frame->skb = skb;
+	frame->echo_skb = NULL;
+	frame->arb = mcp2515_arb_key(cf->can_id);
+	frame->queue = queue;
+	frame->txp = queue;
+	frame->len = mcp2515_set_txbuf(frame->data, cf);
+	frame->cyclic = false;
+	frame->seq = 0;
+	frame->used = true;
+}
+
+/*
+ * Send the "load transmit buffer N" SPI message.  If the frame needs
+ * another priority than the buffer has, write TXBnCTRL along with it.
+ * Asynchronous.
+ */
+static void mcp2515_load_txb(struct net_device *dev, int n)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_tx_frame *frame = &priv->tx_frame[n];
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	if (frame->txp == priv->txp[n]) {
+		buf[0] = MCP2515_INSTRUCTION_LOAD_TXB(n);
+		memcpy(buf + 1, frame->data, frame->len);
+		priv->transfer.len = 1 + frame->len;
+	} else {
+		buf[0] = MCP2515_INSTRUCTION_WRITE;
+		buf[1] = TXBCTRL(n);
+		buf[2] = frame->txp;
+		memcpy(buf + 3, frame->data, frame->len);
+		priv->transfer.len = 3 + frame->len;
+		priv->txp[n] = frame->txp;
+	}
+	priv->txb_seq[n] = frame->seq;
+	priv->complete = mcp2515_load_txb_complete;
+	priv->txb = n;
+
+	if (frame->skb)
+		can_put_echo_skb(frame->skb, dev, n);
+	else
+		priv->can.echo_skb[n] = frame->echo_skb;
+	frame->skb = NULL;
+	frame->echo_skb = NULL;
+
+	mcp2515_spi_async(dev);
 }
 
 /*
- * Send the "request to send transmit buffer 0" SPI message.
+ * Send the "request to send transmit buffer N" SPI message.
  * Asynchronous.
  */
-static void mcp2515_rts_txb0(struct net_device *dev)
+static void mcp2515_rts_txb(struct net_device *dev, int n)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
 	u8 *buf = (u8 *)priv->transfer.tx_buf;
 
-	buf[0] = MCP2515_INSTRUCTION_RTS(0);
+	buf[0] = MCP2515_INSTRUCTION_RTS(n);
 	priv->transfer.len = 1;
-	priv->message.complete = mcp2515_rts_txb0_complete;
+	priv->complete = mcp2515_rts_txb_complete;
 
 	mcp2515_spi_async(dev);
 }
 
 /*
- * Called when the "read CANINTF and EFLG registers" SPI message completes.
+ * Abort the transmission from transmit buffer N by clearing TXREQ.
+ * Asynchronous.
  */
-static void mcp2515_read_flags_complete(void *context)
+static void mcp2515_abort_txb(struct net_device *dev, int n)
 {
-	struct net_device *dev = context;
 	struct mcp2515_priv *priv = netdev_priv(dev);
-	u8 *buf = priv->transfer.rx_buf;
-	unsigned canintf;
-	unsigned long flags;
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
 
-	priv->canintf = canintf = buf[2];
-	priv->eflg = buf[3];
+	buf[0] = MCP2515_INSTRUCTION_BIT_MODIFY;
+	buf[1] = TXBCTRL(n);
+	buf[2] = TXBCTRL_TXREQ;	/* mask */
+	buf[3] = 0;		/* data */
+	priv->transfer.len = 4;
+	priv->complete = mcp2515_abort_txb_complete;
+	priv->tx_polls = 0;
+	mcp2515_stats_add(priv, xstats.tx_abort_requests, 1);
 
-	if (canintf & CANINTF_RX0IF)
-		mcp2515_read_rxb0(dev);
-	else if (canintf & CANINTF_RX1IF)
-		mcp2515_read_rxb1(dev);
-	else if (canintf)
-		mcp2515_clear_canintf(dev);
-	else {
-		spin_lock_irqsave(&priv->lock, flags);
-		if (priv->transmit) {
-			priv->transmit = 0;
-			spin_unlock_irqrestore(&priv->lock, flags);
-			mcp2515_load_txb0(priv->skb, dev);
-		} else if (priv->interrupt) {
-			priv->interrupt = 0;
-			spin_unlock_irqrestore(&priv->lock, flags);
-			mcp2515_read_flags(dev);
-		} else {
-			priv->busy = 0;
-			spin_unlock_irqrestore(&priv->lock, flags);
-		}
-	}
+	mcp2515_spi_async(dev);
 }
 
 /*
- * Called when one of the "read receive buffer i" SPI message completes.
+ * Poll TXREQ again with POLL: at once for the first polls of an abort,
+ * unless the service budget is spent, then spaced by the yield time, so
+ * that a frame held on the bus doesn't keep the SPI bus busy.
  */
-static void mcp2515_read_rxb_complete(void *context)
+static void mcp2515_tx_poll(struct net_device *dev,
+			    void (*poll)(struct net_device *dev))
 {
-	struct net_device *dev = context;
 	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct sk_buff *skb;
-	struct can_frame *frame;
-	u8 *buf = priv->transfer.rx_buf;
 
-	skb = alloc_can_skb(dev, &frame);
-	if (!skb) {
-		dev->stats.rx_dropped++;
+	if (++priv->tx_polls >= MCP2515_TX_POLLS) {
+		mcp2515_yield(priv, poll);
 		return;
 	}
 
-	if (buf[2] & RXBSIDL_IDE) {
-		frame->can_id = buf[1] << 21 | (buf[2] & 0xe0) << 13 |
-			(buf[2] & 3) << 16 | buf[3] << 8 | buf[4] |
-			CAN_EFF_FLAG;
-		if (buf[5] & RXBDLC_RTR)
-			frame->can_id |= CAN_RTR_FLAG;
-	} else {
-		frame->can_id = buf[1] << 3 | buf[2] >> 5;
-		if (buf[2] & RXBSIDL_SRR)
-			frame->can_id |= CAN_RTR_FLAG;
+	if (static_branch_unlikely(&mcp2515_budget_key) &&
+	    mcp2515_service_yield(priv, poll))
+		return;
+
+	poll(dev);
+}
+
+/*
+ * Read TXBnCTRL of the transmit buffer being aborted.
+ * Asynchronous.
+ */
+static void mcp2515_read_txbctrl(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	buf[0] = MCP2515_INSTRUCTION_READ;
+	buf[1] = TXBCTRL(priv->tx_victim);
+	buf[2] = 0;
+	priv->transfer.len = 3;
+	priv->complete = mcp2515_read_txbctrl_complete;
+
+	mcp2515_spi_async(dev);
+}
+
+/*
+ * Request the abort of all pending transmissions with CANCTRL.ABAT.
+ * Asynchronous.
+ */
+static void mcp2515_abort_all(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	buf[0] = MCP2515_INSTRUCTION_BIT_MODIFY;
+	buf[1] = CANCTRL;
+	buf[2] = CANCTRL_ABAT;	/* mask */
+	buf[3] = CANCTRL_ABAT;	/* data */
+	priv->transfer.len = 4;
+	priv->complete = mcp2515_abort_all_complete;
+	WRITE_ONCE(priv->ctrl_async, CANCTRL_ABAT);
+	priv->tx_polls = 0;
+	mcp2515_stats_add(priv, xstats.tx_abort_requests, 1);
+
+	mcp2515_spi_async(dev);
+}
+
+/*
+ * Send the "read status" SPI message.
+ * Asynchronous.
+ */
+static void mcp2515_read_status(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	buf[0] = MCP2515_INSTRUCTION_READ_STATUS;
+	buf[1] = 0;
+	priv->transfer.len = 2;
+	priv->complete = mcp2515_read_status_complete;
+
+	mcp2515_spi_async(dev);
+}
+
+/*
+ * Clear CANCTRL.ABAT, then the TXnIF flags of the frames just released so
+ * that they don't complete the next frames loaded into their buffers.
+ * Asynchronous.
+ */
+static void mcp2515_resume_tx(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	buf[0] = MCP2515_INSTRUCTION_BIT_MODIFY;
+	buf[1] = CANCTRL;
+	buf[2] = CANCTRL_ABAT;	/* mask */
+	buf[3] = 0;		/* data */
+	priv->transfer.len = 4;
+	priv->complete = mcp2515_resume_tx_complete;
+	WRITE_ONCE(priv->ctrl_async, 0);
+
+	mcp2515_spi_async(dev);
+}
+
+/*
+ * Drop the staged frames, when the interface goes down or the
+ * transmission is recovered from a timeout.
+ */
+static void mcp2515_flush_staged(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	u8 staged;
+	int n;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	staged = priv->staged;
+	priv->staged = 0;
+	priv->restage = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	for (n = 0; n <= MCP2515_TX_REQUEUED; n++) {
+		struct mcp2515_tx_frame *frame = &priv->tx_staged[n];
+
+		if (!(staged & BIT(n)))
+			continue;
+
+		if (frame->skb)
+			dev_kfree_skb_any(frame->skb);
+		if (frame->echo_skb)
+			dev_kfree_skb_any(frame->echo_skb);
+		frame->used = false;
+		mcp2515_stats_add(priv, tx_dropped, 1);
+		mcp2515_pm_put(priv);
 	}
+}
+
+/*
+ * Take the most urgent transmit buffer with a pending transmission.
+ * Called with priv->lock held and priv->transmit not zero.
+ */
+static int mcp2515_next_txb(struct mcp2515_priv *priv)
+{
+	int n = fls(priv->transmit) - 1;
 
-	frame->can_dlc = get_can_dlc(buf[5] & 0xf);
+	priv->transmit &= ~BIT(n);
 
-	if (!(frame->can_id & CAN_RTR_FLAG))
-		memcpy(frame->data, buf + 6, frame->can_dlc);
+	return n;
+}
+
+/*
+ * Preemption mode: load the most urgent staged frame into a free transmit
+ * buffer, its own queue's first.  Without a free buffer, abort the buffer
+ * holding the least urgent frame if that one would lose arbitration
+ * against the staged frame anyway.
+ * Returns true if an SPI transaction was started.
+ */
+static bool mcp2515_preempt(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_tx_frame *frame;
+	unsigned long flags;
+	int q = -1, v = -1;
+	int i, n;
+	u8 staged;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	staged = priv->staged;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	for (n = 0; n <= MCP2515_TX_REQUEUED; n++)
+		if ((staged & BIT(n)) &&
+		    (q < 0 || priv->tx_staged[n].arb < priv->tx_staged[q].arb))
+			q = n;
+	if (q < 0)
+		return false;
+	frame = &priv->tx_staged[q];
+
+	for (i = 0; i < MCP2515_TX_BUFS; i++) {
+		n = (frame->queue + i) % MCP2515_TX_BUFS;
+		if (!priv->tx_frame[n].used)
+			break;
+		if (priv->tx_frame[n].arb > frame->arb &&
+		    (v < 0 || priv->tx_frame[n].arb > priv->tx_frame[v].arb))
+			v = n;
+	}
+
+	if (i < MCP2515_TX_BUFS) {
+		priv->tx_frame[n] = *frame;
+		frame->used = false;
 
-	dev->stats.rx_packets++;
-	dev->stats.rx_bytes += frame->can_dlc;
+		spin_lock_irqsave(&priv->lock, flags);
+		priv->staged &= ~BIT(q);
+		priv->restage = 1;
+		spin_unlock_irqrestore(&priv->lock, flags);
+
+		if (q != MCP2515_TX_REQUEUED)
+			netif_wake_subqueue(dev, q);
+		mcp2515_load_txb(dev, n);
+		return true;
+	}
 
-	netif_rx_ni(skb);
+	/* The requeue slot must be free for the aborted frame */
+	if (v < 0 || (q != MCP2515_TX_REQUEUED &&
+		      (staged & BIT(MCP2515_TX_REQUEUED))))
+		return false;
+
+	priv->tx_victim = v;
+	priv->tx_urgent = q;
+	mcp2515_abort_txb(dev, v);
+
+	return true;
 }
 
 /*
- * Transmit a frame if transmission pending, else read and process flags.
+ * Start loading a transmit buffer if there is a frame for it.
+ * Returns true if an SPI transaction was started.
  */
-static void mcp2515_transmit_or_read_flags(struct net_device *dev)
+static bool mcp2515_transmit(struct net_device *dev)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
 	unsigned long flags;
+	int n;
 
 	spin_lock_irqsave(&priv->lock, flags);
+	if (priv->tx_recover) {
+		priv->tx_recover = 0;
+		spin_unlock_irqrestore(&priv->lock, flags);
+		mcp2515_abort_all(dev);
+		return true;
+	}
 	if (priv->transmit) {
-		priv->transmit = 0;
+		n = mcp2515_next_txb(priv);
 		spin_unlock_irqrestore(&priv->lock, flags);
-		mcp2515_load_txb0(priv->skb, dev);
-	} else {
+		mcp2515_load_txb(dev, n);
+		return true;
+	}
+	if (priv->rts) {
+		n = fls(priv->rts) - 1;
+		priv->rts &= ~BIT(n);
 		spin_unlock_irqrestore(&priv->lock, flags);
-		mcp2515_read_flags(dev);
+		mcp2515_rts_txb(dev, n);
+		return true;
+	}
+	if (priv->restage) {
+		priv->restage = 0;
+		spin_unlock_irqrestore(&priv->lock, flags);
+		return mcp2515_preempt(dev);
 	}
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return false;
 }
 
 /*
- * Called when the "read receive buffer 0" SPI message completes.
+ * Tell whether frames of the device get hardware timestamps.
  */
-static void mcp2515_read_rxb0_complete(void *context)
+static bool mcp2515_rx_hwtstamp(const struct mcp2515_priv *priv)
 {
-	struct net_device *dev = context;
-	struct mcp2515_priv *priv = netdev_priv(dev);
-
-	mcp2515_read_rxb_complete(context);
+	return static_branch_unlikely(&mcp2515_hwtstamp_key) &&
+		priv->hwts.rx_filter != HWTSTAMP_FILTER_NONE;
+}
 
-	if (priv->canintf & CANINTF_RX1IF)
-		mcp2515_read_rxb1(dev);
-	else
-		mcp2515_transmit_or_read_flags(dev);
+static bool mcp2515_tx_hwtstamp(const struct mcp2515_priv *priv)
+{
+	return static_branch_unlikely(&mcp2515_hwtstamp_key) &&
+		priv->hwts.tx_type != HWTSTAMP_TX_OFF;
 }
 
 /*
- * Called when the "read receive buffer 1" SPI message completes.
+ * Work out when the events in the flags just read happened: at the
+ * interrupt that signalled them if there was one since the last flags
+ * read, else at the latest when the flags read was started.
  */
-static void mcp2515_read_rxb1_complete(void *context)
+static void mcp2515_flags_tstamp(struct mcp2515_priv *priv)
 {
-	struct net_device *dev = context;
+	unsigned long flags;
 
-	mcp2515_read_rxb_complete(context);
+	priv->tstamp_max = ktime_get_real();
 
-	mcp2515_transmit_or_read_flags(dev);
+	spin_lock_irqsave(&priv->lock, flags);
+	if (priv->irq_tstamp_valid) {
+		priv->tstamp = priv->irq_tstamp;
+		priv->irq_tstamp_valid = 0;
+	} else {
+		priv->tstamp = priv->flags_tstamp;
+	}
+	spin_unlock_irqrestore(&priv->lock, flags);
 }
 
 /*
- * Called when the "clear CANINTF bits" SPI message completes.
+ * Called when the "read CANINTF and EFLG registers" SPI message completes.
  */
-static void mcp2515_clear_canintf_complete(void *context)
+static void mcp2515_read_flags_complete(void *context)
 {
 	struct net_device *dev = context;
 	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = priv->transfer.rx_buf;
+	unsigned canintf, tx_new;
+	unsigned long flags;
+	int n;
 
-	if (priv->canintf & CANINTF_TX0IF) {
-		struct sk_buff *skb = priv->skb;
-		if (skb) {
-			dev->stats.tx_bytes += can_get_echo_skb(dev, 0);
-			dev->stats.tx_packets++;
+	priv->canintf = canintf = buf[2];
+	priv->eflg = buf[3];
+
+	if (static_branch_unlikely(&mcp2515_hwtstamp_key)) {
+		tx_new = canintf & CANINTF_TX & ~priv->tx_tstamped;
+		if ((canintf & (CANINTF_RX | CANINTF_WAKIF)) || tx_new)
+			mcp2515_flags_tstamp(priv);
+
+		/* TXnIF stays set while the receive buffers are read first */
+		for (n = 0; n < MCP2515_TX_BUFS; n++)
+			if (tx_new & (CANINTF_TX0IF << n))
+				priv->tx_tstamp[n] = priv->tstamp;
+		priv->tx_tstamped |= tx_new;
+	}
+
+	if (canintf & (CANINTF_RX | CANINTF_TX))
+		pm_runtime_mark_last_busy(&priv->spi->dev);
+
+	if ((canintf & CANINTF_RX) == CANINTF_RX)
+		mcp2515_stats_add(priv, xstats.rx_rollover, 1);
+
+	/* Bus activity woke the chip, into listen-only mode */
+	if (canintf & CANINTF_WAKIF) {
+		spin_lock_irqsave(&priv->lock, flags);
+		if (priv->asleep && !priv->wake_tstamp) {
+			priv->wake_tstamp =
+				static_branch_unlikely(&mcp2515_hwtstamp_key) ?
+				priv->tstamp : ktime_get_real();
+			mcp2515_stats_add(priv, xstats.bus_wakeups, 1);
 		}
-		priv->skb = NULL;
-		netif_wake_queue(dev);
+		spin_unlock_irqrestore(&priv->lock, flags);
+		pm_request_resume(&priv->spi->dev);
 	}
 
-	if (priv->eflg)
-		mcp2515_clear_eflg(dev);
-	else
-		mcp2515_read_flags(dev);
+	if (canintf & CANINTF_RX0IF)
+		mcp2515_read_rxb(dev, 0);
+	else if (canintf & CANINTF_RX1IF)
+		mcp2515_read_rxb(dev, 1);
+	else if (canintf)
+		mcp2515_clear_canintf(dev);
+	else {
+		while (!mcp2515_transmit(dev)) {
+			spin_lock_irqsave(&priv->lock, flags);
+			if (priv->transmit || priv->rts || priv->restage ||
+			    priv->tx_recover) {
+				spin_unlock_irqrestore(&priv->lock, flags);
+			} else if (priv->interrupt) {
+				priv->interrupt = 0;
+				spin_unlock_irqrestore(&priv->lock, flags);
+				mcp2515_read_flags(dev);
+				return;
+			} else {
+				priv->busy = 0;
+				priv->cycle_xfers = 0;
+				complete(&priv->idle);
+				spin_unlock_irqrestore(&priv->lock, flags);
+				return;
+			}
+		}
+	}
 }
 
 /*
- * Called when the "clear EFLG bits" SPI message completes.
+ * Decode a receive buffer header, starting at RXBnSIDH, into rx_frame.
  */
-static void mcp2515_clear_eflg_complete(void *context)
+static void mcp2515_decode_rxb_header(struct mcp2515_priv *priv, const u8 *buf)
 {
-	struct net_device *dev = context;
-	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct can_frame *frame = &priv->rx_frame;
 
-	/*
-	 * The receive flow chart (figure 4-3) of the data sheet (DS21801E)
-	 * says that, if RXB0CTRL.BUKT is set (our case), the overflow
-	 * flag that is set is EFLG.RX1OVR, when in fact it is EFLG.RX0OVR
-	 * that is set.  To be safe, we test for any one of them.
-	 */
-	if (priv->eflg & (EFLG_RX0OVR | EFLG_RX1OVR))
-		dev->stats.rx_over_errors++;
+	if (buf[1] & RXBSIDL_IDE) {
+		frame->can_id = buf[0] << 21 | (buf[1] & 0xe0) << 13 |
+			(buf[1] & 3) << 16 | buf[2] << 8 | buf[3] |
+			CAN_EFF_FLAG;
+		if (buf[4] & RXBDLC_RTR)
+			frame->can_id |= CAN_RTR_FLAG;
+	} else {
+		frame->can_id = buf[0] << 3 | buf[1] >> 5;
+		if (buf[1] & RXBSIDL_SRR)
+			frame->can_id |= CAN_RTR_FLAG;
+	}
 
-	mcp2515_read_flags(dev);
+	frame->can_dlc = get_can_dlc(buf[4] & 0xf);
+
+	mcp2515_ewma(&priv->rx_dlc, frame->can_id & CAN_RTR_FLAG ?
+		     0 : frame->can_dlc << 4);
 }
 
 /*
- * Called when the "load transmit buffer 0" SPI message completes.
+ * Length of a frame in bits, without stuff bits, plus interframe space.
  */
-static void mcp2515_load_txb0_complete(void *context)
+static unsigned int mcp2515_frame_bits(canid_t can_id, u8 dlc)
 {
-	struct net_device *dev = context;
+	unsigned int bits = (can_id & CAN_EFF_FLAG ? 64 : 44) + 3;
 
-	mcp2515_rts_txb0(dev);
+	if (!(can_id & CAN_RTR_FLAG))
+		bits += dlc * 8;
+
+	return bits;
 }
 
 /*
- * Called when the "request to send transmit buffer 0" SPI message completes.
+ * Estimate when the frame in rx_frame was received.  If both receive
+ * buffers were full, the interrupt was raised for RXB0, and the frame in
+ * RXB1 ended at least its own length later, but before the flags read.
  */
-static void mcp2515_rts_txb0_complete(void *context)
+static ktime_t mcp2515_rx_tstamp(const struct mcp2515_priv *priv)
 {
-	struct net_device *dev = context;
+	const struct can_frame *frame = &priv->rx_frame;
+	u32 bitrate = priv->can.bittiming.bitrate;
+	unsigned int bits;
+	ktime_t ts;
 
-	mcp2515_read_flags(dev);
+	if (priv->rxb == 0 || !(priv->canintf & CANINTF_RX0IF) || !bitrate)
+		return priv->tstamp;
+
+	bits = mcp2515_frame_bits(frame->can_id, frame->can_dlc);
+	ts = ktime_add_ns(priv->tstamp,
+			  div_u64((u64)bits * NSEC_PER_SEC, bitrate));
+
+	return ktime_before(ts, priv->tstamp_max) ? ts : priv->tstamp_max;
 }
 
 /*
- * Interrupt handler.
+ * Find the counters of CAN ID, taking a free slot for a new extended ID.
  */
-static irqreturn_t mcp2515_interrupt(int irq, void *dev_id)
+static struct mcp2515_id_count *mcp2515_id_count(struct mcp2515_id_stats *ids,
+						 canid_t can_id)
 {
-	struct net_device *dev = dev_id;
-	struct mcp2515_priv *priv = netdev_priv(dev);
+	u32 key;
+	int i, slot;
+
+	if (!(can_id & CAN_EFF_FLAG))
+		return &ids->sff[can_id & CAN_SFF_MASK];
+
+	key = can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	slot = hash_32(key, ilog2(MCP2515_EFF_SLOTS));
+	for (i = 0; i < MCP2515_EFF_PROBES; i++) {
+		struct mcp2515_eff_count *e = &ids->eff[slot];
+
+		if (e->can_id == key)
+			return &e->count;
+		if (!e->can_id) {
+			e->can_id = key;
+			return &e->count;
+		}
+		slot = (slot + 1) & (MCP2515_EFF_SLOTS - 1);
+	}
 
-	spin_lock(&priv->lock);
-	if (priv->busy) {
-		priv->interrupt = 1;
-		spin_unlock(&priv->lock);
-		return IRQ_HANDLED;
+	return NULL;
+}
+
+/*
+ * Account a received or transmitted frame to its CAN ID.
+ */
+static void mcp2515_id_stats_add(struct mcp2515_priv *priv,
+				 const struct can_frame *frame, bool tx)
+{
+	struct mcp2515_id_stats *ids = priv->id_stats;
+	struct mcp2515_id_count *count;
+	unsigned int len = frame->can_id & CAN_RTR_FLAG ? 0 : frame->can_dlc;
+	unsigned long flags;
+
+	if (!ids)
+		return;
+
+	flags = u64_stats_update_begin_irqsave(&ids->syncp);
+	count = mcp2515_id_count(ids, frame->can_id);
+	if (!count) {
+		ids->eff_untracked++;
+	} else if (tx) {
+		count->tx_frames++;
+		count->tx_bytes += len;
+	} else {
+		count->rx_frames++;
+		count->rx_bytes += len;
 	}
-	priv->busy = 1;
-	spin_unlock(&priv->lock);
+	u64_stats_update_end_irqrestore(&ids->syncp, flags);
+}
 
-	mcp2515_read_flags(dev);
+/*
+ * Account the frame in the echo skb of transmit buffer N, just sent.
+ */
+static void mcp2515_id_stats_echo(struct mcp2515_priv *priv, int n)
+{
+	struct sk_buff *skb = priv->can.echo_skb[n];
 
-	return IRQ_HANDLED;
+	if (skb)
+		mcp2515_id_stats_add(priv, (struct can_frame *)skb->data, true);
 }
 
 /*
- * Transmit a frame.
+ * Allocate the per CAN ID statistics when the interface goes up with
+ * them enabled.
  */
-static netdev_tx_t mcp2515_start_xmit(struct sk_buff *skb,
-				      struct net_device *dev)
+static int mcp2515_id_stats_start(struct net_device *dev)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
-	unsigned long flags;
+	struct mcp2515_id_stats *ids;
 
-	if (can_dropped_invalid_skb(dev, skb))
-		return NETDEV_TX_OK;
+	if (!(priv->priv_flags & MCP2515_PRIV_ID_STATS))
+		return 0;
 
-	netif_stop_queue(dev);
-	priv->skb = skb;
+	ids = kvzalloc(sizeof(*ids), GFP_KERNEL);
+	if (!ids)
+		return -ENOMEM;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	if (priv->busy) {
-		priv->transmit = 1;
-		spin_unlock_irqrestore(&priv->lock, flags);
-		return NETDEV_TX_OK;
+	u64_stats_init(&ids->syncp);
+	ids->start = ktime_get();
+	priv->id_stats = ids;
+	static_branch_inc(&mcp2515_id_stats_key);
+
+	return 0;
+}
+
+static void mcp2515_id_stats_stop(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (!priv->id_stats)
+		return;
+
+	static_branch_dec(&mcp2515_id_stats_key);
+	kvfree(priv->id_stats);
+	priv->id_stats = NULL;
+}
+
+/*
+ * Tell whether the software filter drops the frame in rx_frame.
+ */
+static bool mcp2515_sw_filter_drop(struct mcp2515_priv *priv)
+{
+	const struct mcp2515_sw_filter *f;
+	canid_t can_id = priv->rx_frame.can_id;
+	bool drop = false;
+
+	rcu_read_lock();
+	f = rcu_dereference(priv->sw_filter);
+	if (!f) {
+		/* accept all */
+	} else if (!(can_id & CAN_EFF_FLAG)) {
+		drop = !test_bit(can_id & CAN_SFF_MASK, f->sff);
+	} else if (!f->eff_all) {
+		u32 id = can_id & CAN_EFF_MASK;
+		unsigned int lo = 0, hi = f->eff_count;
+
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+
+			if (f->eff[mid] < id)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		drop = lo == f->eff_count || f->eff[lo] != id;
+	}
+	rcu_read_unlock();
+
+	return drop;
+}
+
+/*
+ * Decide on the frame whose header was just decoded into rx_frame.
+ */
+static void mcp2515_rx_filter(struct mcp2515_priv *priv)
+{
+	priv->rx_drop = static_branch_unlikely(&mcp2515_sw_filter_key) &&
+		mcp2515_sw_filter_drop(priv);
+}
+
+/*
+ * Tell whether the change filter drops the frame in rx_frame, i.e. its
+ * ID is configured and its payload didn't change since the last one
+ * delivered, within the timeout.
+ */
+static bool mcp2515_rx_unchanged(struct mcp2515_priv *priv)
+{
+	const struct can_frame *frame = &priv->rx_frame;
+	canid_t key = frame->can_id &
+		(CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_EFF_MASK);
+	struct mcp2515_rx_changed_entry *e;
+	struct mcp2515_rx_changed *rc;
+	unsigned int lo = 0, hi, i;
+	bool unchanged = false;
+	u8 data[CAN_MAX_DLEN];
+	ktime_t now;
+
+	rcu_read_lock();
+	rc = rcu_dereference(priv->rx_changed);
+	if (!rc)
+		goto out;
+
+	hi = rc->count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (rc->entry[mid].can_id < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == rc->count || rc->entry[lo].can_id != key)
+		goto out;
+	e = &rc->entry[lo];
+
+	memset(data, 0, sizeof(data));
+	for (i = 0; i < frame->can_dlc; i++)
+		data[i] = frame->data[i] & e->mask[i];
+
+	now = ktime_get();
+	unchanged = e->seen && e->dlc == frame->can_dlc &&
+		!memcmp(e->data, data, sizeof(data));
+	if (unchanged && e->timeout &&
+	    !ktime_before(now, ktime_add(e->delivered, e->timeout)))
+		unchanged = false;
+	if (unchanged)
+		goto out;
+
+	e->seen = true;
+	e->dlc = frame->can_dlc;
+	memcpy(e->data, data, sizeof(data));
+	e->delivered = now;
+ out:
+	rcu_read_unlock();
+
+	return unchanged;
+}
+
+/*
+ * Queue the frame in rx_frame on the RX ring for delivery by NAPI.
+ */
+static void mcp2515_rx_frame(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_rx_entry *entry;
+	unsigned int head = priv->rx_head;
+	unsigned int fill;
+
+	fill = head - smp_load_acquire(&priv->rx_tail);
+	if (fill >= priv->rx_ring_size) {
+		mcp2515_stats_add(priv, rx_dropped, 1);
+		mcp2515_stats_add(priv, xstats.rx_ring_overflow, 1);
+		return;
+	}
+
+	entry = &priv->rx_ring[head & (priv->rx_ring_size - 1)];
+	entry->can_id = priv->rx_frame.can_id;
+	entry->can_dlc = priv->rx_frame.can_dlc;
+	memcpy(entry->data, priv->rx_frame.data, CAN_MAX_DLEN);
+	if (mcp2515_rx_hwtstamp(priv))
+		entry->tstamp = mcp2515_rx_tstamp(priv);
+
+	smp_store_release(&priv->rx_head, head + 1);
+
+	if (fill + 1 > priv->xstats.rx_ring_high_water)
+		mcp2515_gauge(priv, NULL, &priv->xstats.rx_ring_high_water,
+			      fill + 1);
+}
+
+/*
+ * Have NAPI deliver what the SPI engine queued on the RX ring.  Called
+ * after the next transaction has been started, so that skb allocation
+ * and delivery overlap with draining the chip.
+ */
+static void mcp2515_rx_kick(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (in_interrupt()) {
+		napi_schedule(&priv->napi);
+	} else {
+		local_bh_disable();
+		napi_schedule(&priv->napi);
+		local_bh_enable();
+	}
+}
+
+/*
+ * Run the XDP program on a frame from the RX ring.  Returns true if the
+ * frame is to be delivered, as the program left it; sets *redirected if
+ * it was redirected.
+ */
+static bool mcp2515_xdp_run(struct net_device *dev, struct bpf_prog *prog,
+			    struct mcp2515_rx_entry *entry, bool *redirected)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct can_frame *cf;
+	struct xdp_buff xdp;
+	u32 act;
+
+	if (!priv->xdp_page) {
+		priv->xdp_page = dev_alloc_page();
+		if (!priv->xdp_page) {
+			mcp2515_stats_add(priv, xstats.rx_alloc_failed, 1);
+			mcp2515_stats_add(priv, rx_dropped, 1);
+			return false;
+		}
+	}
+
+	xdp.data_hard_start = page_address(priv->xdp_page);
+	xdp.data = xdp.data_hard_start + XDP_PACKET_HEADROOM;
+	xdp_set_data_meta_invalid(&xdp);
+	xdp.data_end = xdp.data + CAN_MTU;
+	xdp.rxq = &priv->xdp_rxq;
+	xdp.frame_sz = PAGE_SIZE;
+
+	cf = xdp.data;
+	memset(cf, 0, CAN_MTU);
+	cf->can_id = entry->can_id;
+	cf->can_dlc = entry->can_dlc;
+	memcpy(cf->data, entry->data, CAN_MAX_DLEN);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		if (xdp.data_end - xdp.data < CAN_MTU)
+			goto aborted;
+		cf = xdp.data;
+		entry->can_id = cf->can_id;
+		entry->can_dlc = min_t(u8, cf->can_dlc, CAN_MAX_DLEN);
+		memcpy(entry->data, cf->data, CAN_MAX_DLEN);
+		mcp2515_stats_add(priv, xstats.xdp_pass, 1);
+		return true;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, &xdp, prog))
+			goto aborted;
+		priv->xdp_page = NULL;
+		*redirected = true;
+		mcp2515_stats_add(priv, xstats.xdp_redirect, 1);
+		return false;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		fallthrough;
+	case XDP_ABORTED:
+ aborted:
+		trace_xdp_exception(dev, prog, act);
+		mcp2515_stats_add(priv, xstats.xdp_aborted, 1);
+		return false;
+	case XDP_DROP:
+		mcp2515_stats_add(priv, xstats.xdp_drop, 1);
+		return false;
+	}
+}
+
+static bool mcp2515_xdp_rx(struct net_device *dev,
+			   struct mcp2515_rx_entry *entry, bool *redirected)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct bpf_prog *prog;
+	bool pass = true;
+
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	if (prog)
+		pass = mcp2515_xdp_run(dev, prog, entry, redirected);
+	rcu_read_unlock();
+
+	return pass;
+}
+
+/*
+ * NAPI poll: pass frames from the RX ring to the network stack.
+ */
+static int mcp2515_poll(struct napi_struct *napi, int budget)
+{
+	struct net_device *dev = napi->dev;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned int tail = priv->rx_tail;
+	unsigned int head = smp_load_acquire(&priv->rx_head);
+	unsigned int packets = 0, bytes = 0, dropped = 0;
+	bool redirected = false;
+	int work_done = 0;
+
+	while (work_done < budget && tail != head) {
+		struct mcp2515_rx_entry *entry =
+			&priv->rx_ring[tail & (priv->rx_ring_size - 1)];
+		struct sk_buff *skb;
+		struct can_frame *frame;
+
+		if (static_branch_unlikely(&mcp2515_xdp_key) &&
+		    !mcp2515_xdp_rx(dev, entry, &redirected))
+			goto next;
+
+		skb = alloc_can_skb(dev, &frame);
+		if (skb) {
+			frame->can_id = entry->can_id;
+			frame->can_dlc = entry->can_dlc;
+			if (!(frame->can_id & CAN_RTR_FLAG))
+				memcpy(frame->data, entry->data,
+				       frame->can_dlc);
+			if (mcp2515_rx_hwtstamp(priv))
+				skb_hwtstamps(skb)->hwtstamp = entry->tstamp;
+
+			packets++;
+			bytes += frame->can_dlc;
+
+			netif_receive_skb(skb);
+		} else {
+			dropped++;
+		}
+
+ next:
+		tail++;
+		work_done++;
+		if (tail == head)
+			head = smp_load_acquire(&priv->rx_head);
+	}
+
+	smp_store_release(&priv->rx_tail, tail);
+
+	if (redirected)
+		xdp_do_flush();
+
+	if (packets) {
+		mcp2515_stats_add(priv, rx_packets, packets);
+		mcp2515_stats_add(priv, rx_bytes, bytes);
+	}
+	if (dropped) {
+		mcp2515_stats_add(priv, rx_dropped, dropped);
+		mcp2515_stats_add(priv, xstats.rx_alloc_failed, dropped);
+	}
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+static int mcp2515_alloc_rx_ring(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	/* A power of 2 of cache lines, so kmalloc aligns it on one */
+	priv->rx_ring = kvcalloc(priv->rx_ring_size, sizeof(*priv->rx_ring),
+				 GFP_KERNEL);
+	if (!priv->rx_ring)
+		return -ENOMEM;
+
+	priv->rx_head = 0;
+	priv->rx_tail = 0;
+
+	return 0;
+}
+
+static void mcp2515_free_rx_ring(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	kvfree(priv->rx_ring);
+	priv->rx_ring = NULL;
+}
+
+/*
+ * Transmit a frame if transmission pending, else read and process flags.
+ */
+static void mcp2515_transmit_or_read_flags(struct net_device *dev)
+{
+	if (!mcp2515_transmit(dev))
+		mcp2515_read_flags(dev);
+}
+
+/*
+ * Deliver the frame of receive buffer i, then read buffer 1 if it was
+ * also full, else go on with transmission or flags.
+ */
+static void mcp2515_read_rxb_done(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (priv->rxb)
+		mcp2515_stats_add(priv, xstats.rx_rxb1, 1);
+	else
+		mcp2515_stats_add(priv, xstats.rx_rxb0, 1);
+
+	if (static_branch_unlikely(&mcp2515_id_stats_key))
+		mcp2515_id_stats_add(priv, &priv->rx_frame, false);
+
+	if (priv->rx_drop)
+		mcp2515_stats_add(priv, xstats.rx_sw_filtered, 1);
+	else if (static_branch_unlikely(&mcp2515_rx_changed_key) &&
+		 mcp2515_rx_unchanged(priv))
+		mcp2515_stats_add(priv, xstats.rx_unchanged, 1);
+	else
+		mcp2515_rx_frame(dev);
+
+	if (priv->rxb == 0 && (priv->canintf & CANINTF_RX1IF))
+		mcp2515_read_rxb(dev, 1);
+	else
+		mcp2515_transmit_or_read_flags(dev);
+
+	mcp2515_rx_kick(dev);
+}
+
+/*
+ * Called when the "read receive buffer i" SPI message completes.
+ */
+static void mcp2515_read_rxb_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = priv->transfer.rx_buf;
+	u64 start = 0;
+
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		start = ktime_get_ns();
+
+	mcp2515_decode_rxb_header(priv, buf + 1);
+	mcp2515_rx_filter(priv);
+	if (!(priv->rx_frame.can_id & CAN_RTR_FLAG) && !priv->rx_drop)
+		memcpy(priv->rx_frame.data, buf + 6, priv->rx_frame.can_dlc);
+
+	mcp2515_read_rxb_done(dev);
+
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		mcp2515_profile(priv, &priv->xstats.rx_path_ns_avg,
+				&priv->xstats.rx_path_ns_max, start);
+}
+
+/*
+ * Called when the "read receive buffer i header" SPI message completes.
+ */
+static void mcp2515_read_rxb_header_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = priv->transfer.rx_buf;
+	u64 start = 0;
+
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		start = ktime_get_ns();
+
+	mcp2515_decode_rxb_header(priv, buf + 2);
+	mcp2515_rx_filter(priv);
+
+	/* Before the data read is submitted: it may complete at once */
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		priv->rx_split_ns = ktime_get_ns() - start;
+
+	mcp2515_read_rxb_data(dev);
+}
+
+/*
+ * Called when the "read receive buffer i data" SPI message completes.
+ */
+static void mcp2515_read_rxb_data_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = priv->transfer.rx_buf;
+	u64 start = 0;
+
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		start = ktime_get_ns();
+
+	memcpy(priv->rx_frame.data, buf + 1, priv->transfer.len - 1);
+
+	mcp2515_read_rxb_done(dev);
+
+	/* Both parts of a split read count as one receive path run */
+	if (static_branch_unlikely(&mcp2515_profile_key))
+		mcp2515_profile(priv, &priv->xstats.rx_path_ns_avg,
+				&priv->xstats.rx_path_ns_max,
+				start - priv->rx_split_ns);
+}
+
+/*
+ * Report the end of transmission from buffer N as hardware timestamp of
+ * the echo skb, and on the socket's error queue if it asked for it.
+ */
+static void mcp2515_tx_tstamp(struct net_device *dev, int n)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct sk_buff *skb = priv->can.echo_skb[n];
+	struct skb_shared_hwtstamps hwts = {
+		.hwtstamp = priv->tx_tstamp[n],
+	};
+
+	if (!skb)
+		return;
+
+	*skb_hwtstamps(skb) = hwts;
+	if (skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS)
+		skb_tstamp_tx(skb, &hwts);
+}
+
+/*
+ * Put the frame of a cyclic entry into the free transmit buffer of its
+ * queue, whose TX queue the caller stopped.  If the buffer still holds
+ * the image, only request to send it.
+ */
+static void mcp2515_cyclic_load(struct net_device *dev,
+				struct mcp2515_cyclic *c)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_tx_frame *frame = &priv->tx_frame[c->queue];
+	const struct mcp2515_cyclic_data *d;
+	unsigned long flags;
+	bool rts_only;
+
+	rcu_read_lock();
+	d = rcu_dereference(c->data);
+	if (!d) {
+		/* Removed while due */
+		rcu_read_unlock();
+		netif_wake_subqueue(dev, c->queue);
+		return;
+	}
+	rts_only = c->reserve && READ_ONCE(priv->txb_seq[c->queue]) == d->seq;
+	frame->arb = d->arb;
+	frame->bytes = d->dlc;
+	frame->seq = d->seq;
+	if (!rts_only) {
+		frame->len = d->len;
+		memcpy(frame->data, d->data, d->len);
+	}
+	rcu_read_unlock();
+
+	frame->skb = NULL;
+	frame->echo_skb = NULL;
+	frame->queue = c->queue;
+	frame->txp = c->queue;
+	frame->can_id = c->can_id;
+	frame->cyclic = true;
+	frame->used = true;
+	c->sent++;
+	if (rts_only)
+		c->rts_only++;
+
+	/*
+	 * The TX queue is stopped for this frame as for one from a socket,
+	 * so restart the TX watchdog's clock for it like dev_hard_start_xmit
+	 * does; else a queue idle for long times out at once.
+	 */
+	netdev_get_tx_queue(dev, c->queue)->trans_start = jiffies;
+
+	/* Like frames from sockets, held up by the engine's reference */
+	pm_runtime_get_noresume(&priv->spi->dev);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (rts_only)
+		priv->rts |= BIT(c->queue);
+	else
+		priv->transmit |= BIT(c->queue);
+	if (priv->busy) {
+		spin_unlock_irqrestore(&priv->lock, flags);
+		return;
 	}
 	priv->busy = 1;
 	spin_unlock_irqrestore(&priv->lock, flags);
 
-	mcp2515_load_txb0(skb, dev);
+	mcp2515_transmit_or_read_flags(dev);
+}
+
+/*
+ * Transmit buffer N was freed: give it to a due cyclic entry, keeping
+ * the TX queue stopped, else wake the queue.  Called with priv->lock
+ * held.
+ */
+static void mcp2515_cyclic_free_txb(struct net_device *dev, int n)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int i;
+
+	if (!priv->cyclic_due[n]) {
+		netif_wake_subqueue(dev, n);
+		return;
+	}
+
+	i = __ffs(priv->cyclic_due[n]);
+	priv->cyclic_due[n] &= ~BIT(i);
+	spin_unlock(&priv->lock);
+	mcp2515_cyclic_load(dev, &priv->cyclic[i]);
+	spin_lock(&priv->lock);
+}
+
+/*
+ * Release the frame of a cyclic entry: into its transmit buffer if the
+ * buffer is free, else as due.
+ */
+static enum hrtimer_restart mcp2515_cyclic_timer(struct hrtimer *timer)
+{
+	struct mcp2515_cyclic *c = container_of(timer, struct mcp2515_cyclic,
+						timer);
+	struct net_device *dev = c->dev;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, c->queue);
+	int i = c - priv->cyclic;
+	ktime_t now = ktime_get();
+	u64 late, overruns;
+	bool load = false;
+
+	late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+	c->late_last_ns = late;
+	c->late_avg_ns = c->late_avg_ns ?
+		c->late_avg_ns - (c->late_avg_ns >> 3) + (late >> 3) : late;
+	if (late > c->late_max_ns)
+		c->late_max_ns = late;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	spin_lock_irq(&priv->lock);
+	if (c->reserve && priv->txb_reserved == c->queue) {
+		/* Still pending after a period, on a busy bus */
+		if (priv->tx_frame[c->queue].used)
+			c->overruns++;
+		else
+			load = true;
+	} else if (!netif_xmit_stopped(txq)) {
+		/* Also after a TX abort, which forgets the due entries */
+		priv->cyclic_due[c->queue] &= ~BIT(i);
+		netif_tx_stop_queue(txq);
+		load = true;
+	} else if (priv->cyclic_due[c->queue] & BIT(i)) {
+		c->overruns++;
+	} else {
+		priv->cyclic_due[c->queue] |= BIT(i);
+	}
+	spin_unlock_irq(&priv->lock);
+	__netif_tx_unlock(txq);
+
+	if (load)
+		mcp2515_cyclic_load(dev, c);
+
+	overruns = hrtimer_forward(timer, now, c->period);
+	if (overruns > 1)
+		c->overruns += overruns - 1;
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Hold a runtime PM reference while cyclic entries run, so that the
+ * chip doesn't sleep between their frames.  Called with cfg_lock held.
+ */
+static void mcp2515_cyclic_pm(struct mcp2515_priv *priv)
+{
+	bool want = false;
+	int i;
+
+	for (i = 0; priv->cyclic_running && i < MCP2515_CYCLIC_MAX; i++)
+		if (rcu_access_pointer(priv->cyclic[i].data))
+			want = true;
+
+	if (want && !priv->cyclic_pm)
+		pm_runtime_get_sync(&priv->spi->dev);
+	else if (!want && priv->cyclic_pm)
+		mcp2515_pm_put(priv);
+	priv->cyclic_pm = want;
+}
+
+/*
+ * Take the transmit buffer of a reserving cyclic entry away from its TX
+ * queue.  The queue isn't stopped, as the TX watchdog would time it out
+ * within one second: mcp2515_select_queue steers frames off it, and
+ * ndo_start_xmit drops those that bypass the selection.  Taking the
+ * queue lock lets a frame being queued there finish; one still in the
+ * buffer completes, then the cyclic frames take it.
+ */
+static void mcp2515_cyclic_reserve(struct net_device *dev,
+				   struct mcp2515_cyclic *c)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, c->queue);
+
+	__netif_tx_lock_bh(txq);
+	spin_lock_irq(&priv->lock);
+	priv->txb_reserved = c->queue;
+	spin_unlock_irq(&priv->lock);
+	__netif_tx_unlock_bh(txq);
+}
+
+/*
+ * Give a reserved transmit buffer back to its TX queue.  If a cyclic
+ * frame is still in it, the queue is stopped until the frame completes,
+ * as mcp2515_cyclic_free_txb then wakes it.
+ */
+static void mcp2515_cyclic_unreserve(struct net_device *dev,
+				     struct mcp2515_cyclic *c)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, c->queue);
+
+	__netif_tx_lock_bh(txq);
+	spin_lock_irq(&priv->lock);
+	priv->txb_reserved = -1;
+	if (priv->tx_frame[c->queue].used)
+		netif_tx_stop_queue(txq);
+	spin_unlock_irq(&priv->lock);
+	__netif_tx_unlock_bh(txq);
+}
+
+/*
+ * Stop a cyclic entry and free it.  Called with cfg_lock held.
+ */
+static void mcp2515_cyclic_remove(struct net_device *dev,
+				  struct mcp2515_cyclic *c)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_cyclic_data *old;
+	unsigned long flags;
+
+	hrtimer_cancel(&c->timer);
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->cyclic_due[c->queue] &= ~BIT(c - priv->cyclic);
+	spin_unlock_irqrestore(&priv->lock, flags);
+	if (c->reserve && priv->cyclic_running)
+		mcp2515_cyclic_unreserve(dev, c);
+
+	old = rcu_dereference_protected(c->data,
+					lockdep_is_held(&priv->cfg_lock));
+	RCU_INIT_POINTER(c->data, NULL);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * Arm the timer of a cyclic entry, its phase after NOW.
+ */
+static void mcp2515_cyclic_arm(struct net_device *dev,
+			       struct mcp2515_cyclic *c, ktime_t now)
+{
+	if (c->reserve)
+		mcp2515_cyclic_reserve(dev, c);
+	hrtimer_start(&c->timer, ktime_add(now, c->phase),
+		      HRTIMER_MODE_ABS_SOFT);
+}
+
+/*
+ * Start the cyclic entries when the interface goes up, phases relative
+ * to the same instant.
+ */
+static void mcp2515_cyclic_start(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	ktime_t now = ktime_get();
+	int i;
+
+	mutex_lock(&priv->cfg_lock);
+	priv->cyclic_running = true;
+	mcp2515_cyclic_pm(priv);
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+		if (rcu_access_pointer(priv->cyclic[i].data))
+			mcp2515_cyclic_arm(dev, &priv->cyclic[i], now);
+	mutex_unlock(&priv->cfg_lock);
+}
+
+static void mcp2515_cyclic_stop(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&priv->cfg_lock);
+	priv->cyclic_running = false;
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+		hrtimer_cancel(&priv->cyclic[i].timer);
+	spin_lock_irqsave(&priv->lock, flags);
+	memset(priv->cyclic_due, 0, sizeof(priv->cyclic_due));
+	priv->txb_reserved = -1;
+	spin_unlock_irqrestore(&priv->lock, flags);
+	mcp2515_cyclic_pm(priv);
+	mutex_unlock(&priv->cfg_lock);
+}
+
+/*
+ * Echo a sent cyclic frame, as the CAN core echoes the frames of
+ * sockets: without a sending socket, local sockets all receive it.
+ */
+static void mcp2515_cyclic_echo(struct net_device *dev,
+				const struct mcp2515_tx_frame *frame)
+{
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	if (!(dev->flags & IFF_ECHO))
+		return;
+
+	skb = alloc_can_skb(dev, &cf);
+	if (!skb)
+		return;
+
+	cf->can_id = frame->can_id;
+	cf->can_dlc = frame->bytes;
+	if (!(frame->can_id & CAN_RTR_FLAG))
+		memcpy(cf->data, frame->data + 5, frame->bytes);
+	skb->pkt_type = PACKET_LOOPBACK;
+
+	netif_rx(skb);
+}
+
+/*
+ * Called when the "clear CANINTF bits" SPI message completes.
+ */
+static void mcp2515_clear_canintf_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	bool preempt = priv->priv_flags & MCP2515_PRIV_TX_PREEMPT;
+	unsigned int tx_packets = 0, tx_bytes = 0;
+	unsigned long flags;
+	int n;
+
+	for (n = 0; n < MCP2515_TX_BUFS; n++) {
+		struct mcp2515_tx_frame *frame = &priv->tx_frame[n];
+
+		if (!(priv->canintf & (CANINTF_TX0IF << n)))
+			continue;
+
+		if (frame->used && frame->cyclic) {
+			if (static_branch_unlikely(&mcp2515_id_stats_key)) {
+				struct can_frame cf = {
+					.can_id = frame->can_id,
+					.can_dlc = frame->bytes,
+				};
+
+				mcp2515_id_stats_add(priv, &cf, true);
+			}
+			mcp2515_cyclic_echo(dev, frame);
+			tx_bytes += frame->bytes;
+			tx_packets++;
+			mcp2515_pm_put(priv);
+		} else if (frame->used) {
+			if (mcp2515_tx_hwtstamp(priv))
+				mcp2515_tx_tstamp(dev, n);
+			if (static_branch_unlikely(&mcp2515_id_stats_key))
+				mcp2515_id_stats_echo(priv, n);
+			tx_bytes += can_get_echo_skb(dev, n);
+			tx_packets++;
+			mcp2515_pm_put(priv);
+		}
+		frame->used = false;
+		if (!preempt) {
+			spin_lock_irqsave(&priv->lock, flags);
+			mcp2515_cyclic_free_txb(dev, n);
+			spin_unlock_irqrestore(&priv->lock, flags);
+		}
+	}
+	priv->tx_tstamped &= ~priv->canintf;
+
+	if (tx_packets) {
+		mcp2515_stats_add(priv, tx_packets, tx_packets);
+		mcp2515_stats_add(priv, tx_bytes, tx_bytes);
+	}
+
+
+	if (preempt && (priv->canintf & CANINTF_TX)) {
+		spin_lock_irqsave(&priv->lock, flags);
+		if (priv->staged)
+			priv->restage = 1;
+		spin_unlock_irqrestore(&priv->lock, flags);
+	}
+
+	if (priv->eflg)
+		mcp2515_clear_eflg(dev);
+	else
+		mcp2515_read_flags(dev);
+}
+
+/*
+ * Called when the "clear EFLG bits" SPI message completes.
+ */
+static void mcp2515_clear_eflg_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	/*
+	 * The receive flow chart (figure 4-3) of the data sheet (DS21801E)
+	 * says that, if RXB0CTRL.BUKT is set (our case), the overflow
+	 * flag that is set is EFLG.RX1OVR, when in fact it is EFLG.RX0OVR
+	 * that is set.  To be safe, we test for any one of them.
+	 */
+	if (priv->eflg & (EFLG_RX0OVR | EFLG_RX1OVR))
+		mcp2515_stats_add(priv, rx_over_errors, 1);
+
+	mcp2515_read_flags(dev);
+}
+
+/*
+ * Called when the "load transmit buffer i" SPI message completes.
+ */
+static void mcp2515_load_txb_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	mcp2515_rts_txb(dev, priv->txb);
+}
+
+/*
+ * Called when the "abort transmit buffer i" SPI message completes.
+ */
+static void mcp2515_abort_txb_complete(void *context)
+{
+	struct net_device *dev = context;
+
+	mcp2515_read_txbctrl(dev);
+}
+
+/*
+ * Called when the "read TXBnCTRL" SPI message completes.  A frame being
+ * transmitted can't be aborted, so poll until TXREQ clears; ABTF then
+ * tells whether the frame was aborted or went out first.  An aborted
+ * frame makes room for the staged frame and waits in the requeue slot,
+ * and the queue of the staged frame is woken.
+ */
+static void mcp2515_read_txbctrl_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 ctrl = ((u8 *)priv->transfer.rx_buf)[2];
+	int v = priv->tx_victim;
+	int u = priv->tx_urgent;
+	struct mcp2515_tx_frame victim;
+	unsigned long flags;
+
+	if (ctrl & TXBCTRL_TXREQ) {
+		mcp2515_tx_poll(dev, mcp2515_read_txbctrl);
+		return;
+	}
+
+	if (!(ctrl & TXBCTRL_ABTF)) {
+		/* TXnIF will complete it, and then free the buffer */
+		mcp2515_stats_add(priv, xstats.tx_preempt_late, 1);
+		mcp2515_read_flags(dev);
+		return;
+	}
+
+	victim = priv->tx_frame[v];
+	victim.echo_skb = priv->can.echo_skb[v];
+	priv->can.echo_skb[v] = NULL;
+
+	priv->tx_frame[v] = priv->tx_staged[u];
+	priv->tx_frame[v].txp = MCP2515_TXP_PREEMPT;
+	priv->tx_staged[u].used = false;
+	priv->tx_staged[MCP2515_TX_REQUEUED] = victim;
+	mcp2515_stats_add(priv, xstats.tx_preempted, 1);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->staged &= ~BIT(u);
+	priv->staged |= BIT(MCP2515_TX_REQUEUED);
+	priv->restage = 1;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	if (u != MCP2515_TX_REQUEUED)
+		netif_wake_subqueue(dev, u);
+
+	mcp2515_load_txb(dev, v);
+}
+
+/*
+ * Called when the "abort all pending transmissions" SPI message completes.
+ */
+static void mcp2515_abort_all_complete(void *context)
+{
+	struct net_device *dev = context;
+
+	mcp2515_read_status(dev);
+}
+
+/*
+ * Release every frame the driver holds, once no transmit buffer has
+ * TXREQ set any more: those whose TXnIF is set in STATUS went out and
+ * are echoed, the others were aborted, or never loaded, and are dropped.
+ */
+static void mcp2515_release_tx_frames(struct net_device *dev, u8 status)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->transmit = 0;
+	priv->rts = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	for (n = 0; n < MCP2515_TX_BUFS; n++) {
+		struct mcp2515_tx_frame *frame = &priv->tx_frame[n];
+
+		if (!frame->used)
+			continue;
+
+		if (frame->skb) {
+			dev_kfree_skb_any(frame->skb);
+			frame->skb = NULL;
+			mcp2515_stats_add(priv, tx_dropped, 1);
+			mcp2515_stats_add(priv, xstats.tx_timeout_aborted, 1);
+		} else if (frame->cyclic) {
+			if (status & STATUS_TXIF(n)) {
+				mcp2515_cyclic_echo(dev, frame);
+				mcp2515_stats_add(priv, tx_bytes, frame->bytes);
+				mcp2515_stats_add(priv, tx_packets, 1);
+			}
+		} else if (status & STATUS_TXIF(n)) {
+			if (static_branch_unlikely(&mcp2515_id_stats_key))
+				mcp2515_id_stats_echo(priv, n);
+			mcp2515_stats_add(priv, tx_bytes,
+					  can_get_echo_skb(dev, n));
+			mcp2515_stats_add(priv, tx_packets, 1);
+			mcp2515_stats_add(priv, xstats.tx_timeout_completed, 1);
+		} else {
+			can_free_echo_skb(dev, n);
+			mcp2515_stats_add(priv, tx_aborted_errors, 1);
+			mcp2515_stats_add(priv, xstats.tx_timeout_aborted, 1);
+		}
+		frame->used = false;
+		mcp2515_pm_put(priv);
+	}
+	priv->tx_tstamped = 0;
+
+	mcp2515_flush_staged(dev);
+}
+
+/*
+ * Called when the "read status" SPI message completes during a TX timeout
+ * recovery.
+ */
+static void mcp2515_read_status_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 status = ((u8 *)priv->transfer.rx_buf)[1];
+
+	/* A frame on the bus completes or fails before it's aborted */
+	if (status & STATUS_TXREQ_ALL) {
+		mcp2515_tx_poll(dev, mcp2515_read_status);
+		return;
+	}
+
+	mcp2515_release_tx_frames(dev, status);
+	mcp2515_resume_tx(dev);
+}
+
+/*
+ * Called when the "clear CANCTRL.ABAT" SPI message completes.
+ */
+static void mcp2515_resume_tx_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	u8 *buf = (u8 *)priv->transfer.tx_buf;
+
+	netif_tx_wake_all_queues(dev);
+
+	/* Then clear the TXnIF flags, and resync with a flags read */
+	priv->canintf = 0;
+	priv->eflg = 0;
+	buf[0] = MCP2515_INSTRUCTION_BIT_MODIFY;
+	buf[1] = CANINTF;
+	buf[2] = CANINTF_TX;	/* mask */
+	buf[3] = 0;		/* data */
+	priv->transfer.len = 4;
+	priv->complete = mcp2515_clear_canintf_complete;
+
+	mcp2515_spi_async(dev);
+}
+
+/*
+ * Called when the "request to send transmit buffer i" SPI message
+ * completes.
+ */
+static void mcp2515_rts_txb_complete(void *context)
+{
+	struct net_device *dev = context;
+
+	mcp2515_transmit_or_read_flags(dev);
+}
+
+/*
+ * Called when any async SPI message completes; dispatches to the
+ * completion function of the transaction.
+ */
+static void mcp2515_spi_complete(void *context)
+{
+	struct net_device *dev = context;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (rx_read_mode == MCP2515_RX_READ_AUTO)
+		mcp2515_spi_cost_update(priv);
+
+	mcp2515_spi_bus_release(priv->bus);
+
+	priv->complete(context);
+}
+
+/*
+ * Record when the interrupt fired, unless the SPI engine has not yet
+ * consumed an earlier one.  Called with priv->lock held.
+ */
+static ktime_t mcp2515_irq_now(void)
+{
+	if (static_branch_unlikely(&mcp2515_hwtstamp_key))
+		return ktime_get_real();
+	return 0;
+}
+
+static void mcp2515_irq_tstamp(struct mcp2515_priv *priv, ktime_t now)
+{
+	if (!priv->irq_tstamp_valid) {
+		priv->irq_tstamp = now;
+		priv->irq_tstamp_valid = 1;
+	}
+}
+
+/*
+ * Interrupt handler.
+ */
+static irqreturn_t mcp2515_interrupt(int irq, void *dev_id)
+{
+	struct net_device *dev = dev_id;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	ktime_t now = mcp2515_irq_now();
+
+	spin_lock(&priv->lock);
+	mcp2515_irq_tstamp(priv, now);
+	if (priv->busy) {
+		priv->interrupt = 1;
+		spin_unlock(&priv->lock);
+		return IRQ_HANDLED;
+	}
+	priv->busy = 1;
+	spin_unlock(&priv->lock);
+
+	mcp2515_read_flags(dev);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Resume the SPI engine after it yielded the bus.
+ */
+static enum hrtimer_restart mcp2515_yield_timer(struct hrtimer *timer)
+{
+	struct mcp2515_priv *priv = container_of(timer, struct mcp2515_priv,
+						 yield_timer);
+
+	priv->yield_resume(dev_get_drvdata(&priv->spi->dev));
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Level interrupt hard handler: timestamp the interrupt, the line stays
+ * masked until the thread returns.
+ */
+static irqreturn_t mcp2515_interrupt_level(int irq, void *dev_id)
+{
+	struct net_device *dev = dev_id;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	ktime_t now = mcp2515_irq_now();
+
+	spin_lock(&priv->lock);
+	mcp2515_irq_tstamp(priv, now);
+	spin_unlock(&priv->lock);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * Start the SPI engine for an interrupt, from a threaded handler.
+ */
+static void mcp2515_irq_kick(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	bool start = false;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	reinit_completion(&priv->idle);
+	if (priv->busy) {
+		priv->interrupt = 1;
+	} else {
+		priv->busy = 1;
+		start = true;
+	}
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	if (start)
+		mcp2515_read_flags(dev);
+}
+
+/*
+ * Wait for the SPI engine started by mcp2515_irq_kick to go idle, which
+ * it only does after reading CANINTF as zero, i.e. with the chip no
+ * longer pulling the line.  On timeout the line is unmasked anyway, and
+ * fires again if still low.
+ */
+static void mcp2515_irq_wait(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (!wait_for_completion_timeout(&priv->idle,
+			msecs_to_jiffies(MCP2515_IRQ_THREAD_TIMEOUT_MS)))
+		netdev_dbg(dev, "SPI engine busy, unmasking interrupt\n");
+}
+
+/*
+ * Level interrupt thread: run the SPI engine until it goes idle.
+ */
+static irqreturn_t mcp2515_interrupt_thread(int irq, void *dev_id)
+{
+	struct net_device *dev = dev_id;
+
+	mcp2515_irq_kick(dev);
+	mcp2515_irq_wait(dev);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Tell whether a chip on a shared line has a pending interrupt.  READ
+ * STATUS (2 bytes) shows the receive and transmit interrupts; only if
+ * none is pending and other interrupts are enabled, read CANINTF
+ * (3 bytes) for the error and wakeup ones.  A busy SPI engine reads the
+ * flags anyway.
+ */
+static bool mcp2515_irq_pending(struct mcp2515_priv *priv)
+{
+	u8 caninte = READ_ONCE(priv->regs[CANINTE]);
+	const u8 cmd = MCP2515_INSTRUCTION_READ_STATUS;
+	unsigned long flags;
+	u8 val;
+	int busy;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	busy = priv->busy;
+	spin_unlock_irqrestore(&priv->lock, flags);
+	if (busy)
+		return true;
+
+	if (spi_write_then_read(priv->spi, &cmd, 1, &val, 1))
+		return true;
+
+	if (val & (STATUS_RX0IF | STATUS_RX1IF | STATUS_TXIF(0) |
+		   STATUS_TXIF(1) | STATUS_TXIF(2)))
+		return true;
+
+	if (!(caninte & ~(CANINTE_RX | CANINTE_TX)))
+		return false;
+
+	if (mcp2515_read_reg(priv->spi, CANINTF, &val))
+		return true;
+
+	return val & caninte;
+}
+
+/*
+ * Shared line hard handler: which chips fired is only known from the
+ * thread, which gets the interrupt time from here.
+ */
+static irqreturn_t mcp2515_interrupt_shared(int irq, void *dev_id)
+{
+	struct mcp2515_irq_line *line = dev_id;
+
+	line->tstamp = mcp2515_irq_now();
+
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * Shared line dispatcher: start the SPI engines of all chips with pending
+ * interrupts, so they are served in parallel, then wait for them all.
+ * The chips are checked in a different order every time, so no chip is
+ * always served last on a congested SPI bus.
+ */
+static irqreturn_t mcp2515_interrupt_dispatch(int irq, void *dev_id)
+{
+	struct mcp2515_irq_line *line = dev_id;
+	irqreturn_t ret = IRQ_NONE;
+	struct mcp2515_priv *priv;
+	unsigned long flags;
+
+	mutex_lock(&line->lock);
+
+	list_for_each_entry(priv, &line->chips, irq_node) {
+		priv->irq_kicked = mcp2515_irq_pending(priv);
+		if (!priv->irq_kicked)
+			continue;
+
+		spin_lock_irqsave(&priv->lock, flags);
+		mcp2515_irq_tstamp(priv, line->tstamp);
+		spin_unlock_irqrestore(&priv->lock, flags);
+
+		mcp2515_irq_kick(dev_get_drvdata(&priv->spi->dev));
+		ret = IRQ_HANDLED;
+	}
+
+	list_for_each_entry(priv, &line->chips, irq_node)
+		if (priv->irq_kicked)
+			mcp2515_irq_wait(dev_get_drvdata(&priv->spi->dev));
+
+	if (!list_empty(&line->chips))
+		list_rotate_left(&line->chips);
+
+	mutex_unlock(&line->lock);
+
+	return ret;
+}
+
+/*
+ * Join the dispatcher of the interrupt line, requesting it for the first
+ * chip on it.  The chip is on the line before the request, so the first
+ * interrupt finds it.
+ */
+static int mcp2515_irq_line_add(struct mcp2515_priv *priv)
+{
+	struct mcp2515_irq_line *line;
+	int irq = priv->spi->irq;
+	int err = 0;
+
+	mutex_lock(&mcp2515_irq_lines_lock);
+
+	list_for_each_entry(line, &mcp2515_irq_lines, node)
+		if (line->irq == irq)
+			goto found;
+
+	line = kzalloc(sizeof(*line), GFP_KERNEL);
+	if (!line) {
+		err = -ENOMEM;
+		goto out;
+	}
+	line->irq = irq;
+	mutex_init(&line->lock);
+	INIT_LIST_HEAD(&line->chips);
+	list_add_tail(&priv->irq_node, &line->chips);
+	priv->irq_line = line;
+
+	err = request_threaded_irq(irq, mcp2515_interrupt_shared,
+				   mcp2515_interrupt_dispatch,
+				   IRQF_TRIGGER_LOW | IRQF_ONESHOT | IRQF_SHARED,
+				   KBUILD_MODNAME, line);
+	if (err) {
+		priv->irq_line = NULL;
+		kfree(line);
+		goto out;
+	}
+	list_add(&line->node, &mcp2515_irq_lines);
+	goto out;
+
+ found:
+	mutex_lock(&line->lock);
+	list_add_tail(&priv->irq_node, &line->chips);
+	mutex_unlock(&line->lock);
+	priv->irq_line = line;
+ out:
+	mutex_unlock(&mcp2515_irq_lines_lock);
+
+	return err;
+}
+
+/*
+ * Leave the dispatcher of the interrupt line, freeing it after the last
+ * chip.
+ */
+static void mcp2515_irq_line_del(struct mcp2515_priv *priv)
+{
+	struct mcp2515_irq_line *line = priv->irq_line;
+	bool last;
+
+	mutex_lock(&mcp2515_irq_lines_lock);
+
+	mutex_lock(&line->lock);
+	list_del(&priv->irq_node);
+	last = list_empty(&line->chips);
+	mutex_unlock(&line->lock);
+
+	if (last)
+		list_del(&line->node);
+
+	mutex_unlock(&mcp2515_irq_lines_lock);
+
+	if (last) {
+		free_irq(line->irq, line);
+		kfree(line);
+	}
+	priv->irq_line = NULL;
+}
+
+/*
+ * Request the interrupt as selected by the irq_mode parameter.
+ */
+static int mcp2515_request_irq(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+
+	priv->irq_mode = irq_mode;
+	switch (priv->irq_mode) {
+	case MCP2515_IRQ_SHARED:
+		return mcp2515_irq_line_add(priv);
+	case MCP2515_IRQ_LEVEL:
+		return request_threaded_irq(spi->irq, mcp2515_interrupt_level,
+					    mcp2515_interrupt_thread,
+					    IRQF_TRIGGER_LOW | IRQF_ONESHOT,
+					    dev->name, dev);
+	default:
+		priv->irq_mode = MCP2515_IRQ_EDGE;
+		return request_irq(spi->irq, mcp2515_interrupt,
+				   IRQF_TRIGGER_FALLING, dev->name, dev);
+	}
+}
+
+static void mcp2515_free_irq(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (priv->irq_mode == MCP2515_IRQ_SHARED)
+		mcp2515_irq_line_del(priv);
+	else
+		free_irq(priv->spi->irq, dev);
+}
+
+/*
+ * Wake the queues stopped while the chip was asleep.
+ */
+static void mcp2515_pm_wake_queues(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	u8 stopped;
+	int n;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->asleep = 0;
+	stopped = priv->tx_pm_stopped;
+	priv->tx_pm_stopped = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	for (n = 0; n < MCP2515_TX_BUFS; n++)
+		if (stopped & BIT(n))
+			netif_wake_subqueue(dev, n);
+}
+
+/*
+ * Safety net for the interrupt driven SPI engine.  If a transaction
+ * failed to be submitted, leaving the engine busy with nothing queued in
+ * the controller, or it is idle while CANINTF shows pending events (e.g.
+ * a lost edge), restart it with a flags read.
+ */
+static void mcp2515_stall_work(struct work_struct *work)
+{
+	struct mcp2515_priv *priv = container_of(to_delayed_work(work),
+						 struct mcp2515_priv,
+						 stall_work);
+	struct net_device *dev = dev_get_drvdata(&priv->spi->dev);
+	bool rescue = false, pm_stopped;
+	unsigned long flags;
+	u8 canintf;
+	int busy;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	busy = priv->busy;
+	pm_stopped = priv->tx_pm_stopped && !priv->asleep;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	/* Stopped by a transmission racing with a suspend that failed */
+	if (pm_stopped)
+		mcp2515_pm_wake_queues(dev);
+
+	if (busy) {
+		if (READ_ONCE(priv->spi_failed)) {
+			WRITE_ONCE(priv->spi_failed, false);
+			netdev_warn(dev, "SPI engine stalled, restarting\n");
+			mcp2515_stats_add(priv, xstats.stall_rescued_busy, 1);
+			rescue = true;
+		}
+	} else if (!mcp2515_read_reg(priv->spi, CANINTF, &canintf) &&
+		   (canintf & ~CANINTF_WAKIF)) {
+		spin_lock_irqsave(&priv->lock, flags);
+		if (!priv->busy) {
+			priv->busy = 1;
+			mcp2515_stats_add(priv, xstats.stall_rescued_idle, 1);
+			rescue = true;
+		}
+		spin_unlock_irqrestore(&priv->lock, flags);
+	}
+
+	if (rescue)
+		mcp2515_read_flags(dev);
+
+	schedule_delayed_work(&priv->stall_work,
+			      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+}
+
+/*
+ * Without an mqprio configuration, map skb->priority to a TX queue the
+ * way pfifo_fast maps it to a band: its most urgent band goes to TXB2.
+ */
+static const u8 mcp2515_prio2queue[TC_PRIO_MAX + 1] = {
+	1, 0, 0, 0, 1, 0, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+static u16 mcp2515_select_queue(struct net_device *dev, struct sk_buff *skb,
+				struct net_device *sb_dev)
+{
+	const struct mcp2515_priv *priv = netdev_priv(dev);
+	u16 q;
+
+	if (netdev_get_num_tc(dev))
+		q = netdev_pick_tx(dev, skb, sb_dev);
+	else
+		q = mcp2515_prio2queue[skb->priority & TC_PRIO_MAX];
+
+	/* The buffer of a reserving cyclic entry, next less urgent one */
+	if (q == READ_ONCE(priv->txb_reserved))
+		q = q ? q - 1 : 1;
+
+	return q;
+}
+
+/*
+ * The chip is asleep, going to sleep or waking up: keep the frame in the
+ * qdisc until the runtime resume started by the caller, or a failed
+ * suspend, wakes the queue.  With runtime PM disabled or failed (ERR
+ * from pm_runtime_get), no wakeup would come: drop the frame.
+ */
+static netdev_tx_t mcp2515_xmit_asleep(struct sk_buff *skb,
+				       struct net_device *dev, u16 n, int err)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+
+	pm_runtime_put_noidle(&priv->spi->dev);
+
+	if (err < 0 && err != -EINPROGRESS) {
+		dev_kfree_skb_any(skb);
+		mcp2515_stats_add(priv, tx_dropped, 1);
+		return NETDEV_TX_OK;
+	}
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (priv->asleep && !priv->wake_tstamp)
+		priv->wake_tstamp = ktime_get_real();
+	priv->tx_pm_stopped |= BIT(n);
+	netif_stop_subqueue(dev, n);
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return NETDEV_TX_BUSY;
+}
+
+/*
+ * Transmit a frame through the transmit buffer of its queue, or in
+ * preemption mode stage it for the SPI engine to place.
+ */
+static netdev_tx_t __mcp2515_start_xmit(struct sk_buff *skb,
+					struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	bool preempt = priv->priv_flags & MCP2515_PRIV_TX_PREEMPT;
+	u16 n = skb_get_queue_mapping(skb);
+	struct mcp2515_tx_frame *frame;
+	unsigned long flags;
+	int err;
+
+	if (can_dropped_invalid_skb(dev, skb))
+		return NETDEV_TX_OK;
+
+	/* Reserved by a cyclic entry, past mcp2515_select_queue */
+	if (unlikely(n == READ_ONCE(priv->txb_reserved))) {
+		dev_kfree_skb_any(skb);
+		mcp2515_stats_add(priv, tx_dropped, 1);
+		return NETDEV_TX_OK;
+	}
+
+	/* The frame keeps the chip awake until it's sent */
+	err = pm_runtime_get(&priv->spi->dev);
+	if (err != 1)
+		return mcp2515_xmit_asleep(skb, dev, n, err);
+
+	if ((skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+	    mcp2515_tx_hwtstamp(priv))
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+	skb_tx_timestamp(skb);
+
+	if (preempt) {
+		spin_lock_irqsave(&priv->lock, flags);
+		if (priv->staged & BIT(n)) {
+			netif_stop_subqueue(dev, n);
+			spin_unlock_irqrestore(&priv->lock, flags);
+			mcp2515_pm_put(priv);
+			return NETDEV_TX_BUSY;
+		}
+		spin_unlock_irqrestore(&priv->lock, flags);
+		frame = &priv->tx_staged[n];
+	} else {
+		frame = &priv->tx_frame[n];
+		/*
+		 * The queue stays stopped while its buffer is in use; if it
+		 * was woken early, the completion or the TX watchdog wakes
+		 * it again.
+		 */
+		if (WARN_ON_ONCE(frame->used)) {
+			netif_stop_subqueue(dev, n);
+			mcp2515_pm_put(priv);
+			return NETDEV_TX_BUSY;
+		}
+	}
+
+	netif_stop_subqueue(dev, n);
+	mcp2515_tx_frame_init(frame, skb, n);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (preempt) {
+		priv->staged |= BIT(n);
+		priv->restage = 1;
+	} else {
+		priv->transmit |= BIT(n);
+	}
+	if (priv->busy) {
+		spin_unlock_irqrestore(&priv->lock, flags);
+		return NETDEV_TX_OK;
+	}
+	priv->busy = 1;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	mcp2515_transmit_or_read_flags(dev);
+
+	return NETDEV_TX_OK;
+}
+
+static netdev_tx_t mcp2515_start_xmit(struct sk_buff *skb,
+				      struct net_device *dev)
+{
+	struct mcp2515_priv *priv;
+	netdev_tx_t ret;
+	u64 start;
+
+	if (!static_branch_unlikely(&mcp2515_profile_key))
+		return __mcp2515_start_xmit(skb, dev);
+
+	priv = netdev_priv(dev);
+	start = ktime_get_ns();
+	ret = __mcp2515_start_xmit(skb, dev);
+	mcp2515_profile(priv, &priv->xstats.tx_path_ns_avg,
+			&priv->xstats.tx_path_ns_max, start);
+
+	return ret;
+}
+
+/*
+ * Called by the TX watchdog when a queue made no progress for
+ * watchdog_timeo: a TXnIF interrupt was lost, or a frame is never
+ * acknowledged and retransmitted forever.  Have the SPI engine abort the
+ * transmit buffers and resync.
+ */
+static void mcp2515_tx_timeout(struct net_device *dev, unsigned int txqueue)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+
+	netdev_warn(dev, "TX timeout on queue %u, aborting transmissions\n",
+		    txqueue);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	mcp2515_stats_add(priv, xstats.tx_timeout, 1);
+	priv->tx_recover = 1;
+	if (priv->busy) {
+		spin_unlock_irqrestore(&priv->lock, flags);
+		return;
+	}
+	priv->busy = 1;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	mcp2515_transmit_or_read_flags(dev);
+}
+
+/*
+ * Cancel the yield timer.  An engine that yielded stays busy until the
+ * timer resumes it, so without the timer it is idle: end its cycle.
+ */
+static void mcp2515_yield_cancel(struct mcp2515_priv *priv)
+{
+	unsigned long flags;
+
+	if (!hrtimer_cancel(&priv->yield_timer))
+		return;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->busy = 0;
+	priv->cycle_xfers = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+}
+
+/*
+ * Wait for the async SPI engine to finish, once nothing can restart it.
+ * An engine still running may yield, so the yield timer is cancelled on
+ * every round.
+ */
+static void mcp2515_wait_idle(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	unsigned long timeout = jiffies + HZ;
+	unsigned long flags;
+	int busy;
+
+	do {
+		mcp2515_yield_cancel(priv);
+		spin_lock_irqsave(&priv->lock, flags);
+		busy = priv->busy;
+		spin_unlock_irqrestore(&priv->lock, flags);
+		if (!busy)
+			return;
+
+		usleep_range(100, 200);
+	} while (!time_after(jiffies, timeout));
+
+	netdev_err(dev, "SPI engine still busy\n");
+}
+
+/*
+ * Called when the network device transitions to the up state.
+ */
+static int mcp2515_open(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+	int err;
+
+	err = pm_runtime_get_sync(&spi->dev);
+	if (err < 0)
+		goto failed_pm;
+
+	mcp2515_power_switch(priv, 1);
+
+	err = open_candev(dev);
+	if (err)
+		goto failed_open;
+
+	err = mcp2515_alloc_rx_ring(dev);
+	if (err)
+		goto failed_ring;
+
+	err = mcp2515_id_stats_start(dev);
+	if (err)
+		goto failed_id_stats;
+
+	err = xdp_rxq_info_reg(&priv->xdp_rxq, dev, 0);
+	if (err)
+		goto failed_xdp;
+	err = xdp_rxq_info_reg_mem_model(&priv->xdp_rxq,
+					 MEM_TYPE_PAGE_ORDER0, NULL);
+	if (err)
+		goto failed_xdp_mem;
+
+	napi_enable(&priv->napi);
+
+	err = mcp2515_request_irq(dev);
+	if (err)
+		goto failed_irq;
+
+	err = mcp2515_chip_start(dev);
+	if (err)
+		goto failed_start;
+
+	netif_tx_start_all_queues(dev);
+
+	priv->spi_failed = false;
+	schedule_delayed_work(&priv->stall_work,
+			      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+
+	priv->pm_up = true;
+	mcp2515_cyclic_start(dev);
+	mcp2515_pm_put(priv);
+
+	return 0;
+
+ failed_start:
+	mcp2515_free_irq(dev);
+ failed_irq:
+	napi_disable(&priv->napi);
+ failed_xdp_mem:
+	xdp_rxq_info_unreg(&priv->xdp_rxq);
+ failed_xdp:
+	mcp2515_id_stats_stop(dev);
+ failed_id_stats:
+	mcp2515_free_rx_ring(dev);
+ failed_ring:
+	close_candev(dev);
+ failed_open:
+	mcp2515_power_switch(priv, 0);
+ failed_pm:
+	pm_runtime_put(&spi->dev);
+	return err;
+}
+
+/*
+ * Called when the network device transitions to the down state.
+ */
+static int mcp2515_close(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+
+	pm_runtime_get_sync(&spi->dev);
+	mcp2515_cyclic_stop(dev);
+	priv->pm_up = false;
+	priv->tx_pm_stopped = 0;
+
+	netif_tx_stop_all_queues(dev);
+	cancel_delayed_work_sync(&priv->stall_work);
+	mcp2515_chip_stop(dev);
+	mcp2515_free_irq(dev);
+	mcp2515_yield_cancel(priv);
+	mcp2515_wait_idle(dev);
+	mcp2515_flush_staged(dev);
+	mcp2515_drop_tx_frames(dev);
+
+	napi_disable(&priv->napi);
+	if (priv->xdp_page) {
+		put_page(priv->xdp_page);
+		priv->xdp_page = NULL;
+	}
+	xdp_rxq_info_unreg(&priv->xdp_rxq);
+	mcp2515_id_stats_stop(dev);
+	mcp2515_free_rx_ring(dev);
+
+	mcp2515_power_switch(priv, 0);
+
+	close_candev(dev);
+
+	pm_runtime_put(&spi->dev);
+
+	return 0;
+}
+
+/*
+ * Set up SPI messages.
+ */
+static void mcp2515_setup_spi_messages(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct device *device;
+	void *buf;
+	dma_addr_t dma;
+
+	spi_message_init(&priv->message);
+	priv->message.complete = mcp2515_spi_complete;
+	priv->message.context = dev;
+
+	/* FIXME */
+	device = &priv->spi->dev;
+	device->coherent_dma_mask = 0xffffffff;
+
+	BUILD_BUG_ON(MCP2515_DMA_SIZE <
+		     sizeof(priv->tx_buf) + sizeof(priv->rx_buf));
+
+	buf = dma_alloc_coherent(device, MCP2515_DMA_SIZE, &dma, GFP_KERNEL);
+	if (buf) {
+		priv->transfer.tx_buf = buf;
+		priv->transfer.rx_buf = buf + MCP2515_DMA_SIZE / 2;
+		priv->transfer.tx_dma = dma;
+		priv->transfer.rx_dma = dma + MCP2515_DMA_SIZE / 2;
+		priv->message.is_dma_mapped = 1;
+	} else {
+		priv->transfer.tx_buf = priv->tx_buf;
+		priv->transfer.rx_buf = priv->rx_buf;
+	}
+
+	spi_message_add_tail(&priv->transfer, &priv->message);
+}
+
+static void mcp2515_cleanup_spi_messages(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	if (!priv->message.is_dma_mapped)
+		return;
+
+	dma_free_coherent(&priv->spi->dev, MCP2515_DMA_SIZE,
+			  (void *)priv->transfer.tx_buf, priv->transfer.tx_dma);
+}
+
+static int mcp2515_set_mode(struct net_device *dev, enum can_mode mode)
+{
+	int err;
+
+	switch (mode) {
+	case CAN_MODE_START:
+		err = mcp2515_chip_start(dev);
+		if (err)
+			return err;
+
+		netif_tx_wake_all_queues(dev);
+		break;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static int mcp2515_get_berr_counter(const struct net_device *dev,
+				    struct can_berr_counter *bec)
+{
+	const struct mcp2515_priv *priv = netdev_priv(dev);
+	int err;
+	u8 reg_tec, reg_rec;
+
+	err = mcp2515_read_2regs(priv->spi, TEC, &reg_tec, &reg_rec);
+	if (err)
+		return err;
+
+	bec->txerr = reg_tec;
+	bec->rxerr = reg_rec;
+
+	return 0;
+}
+
+/*
+ * Enable or disable hardware timestamps.  While any device has them
+ * enabled, the frame path takes the interrupt and flags read times.
+ * Times recorded while the key was off are 0, so they are dropped when
+ * the device enables timestamps.
+ */
+static int mcp2515_set_hwtstamp(struct net_device *dev, struct ifreq *ifr)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct hwtstamp_config config;
+	unsigned long flags;
+	bool was, now;
+
+	if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+		return -EFAULT;
+
+	if (config.flags)
+		return -EINVAL;
+
+	if (config.tx_type != HWTSTAMP_TX_OFF &&
+	    config.tx_type != HWTSTAMP_TX_ON)
+		return -ERANGE;
+
+	if (config.rx_filter != HWTSTAMP_FILTER_NONE)
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+	was = priv->hwts.tx_type != HWTSTAMP_TX_OFF ||
+		priv->hwts.rx_filter != HWTSTAMP_FILTER_NONE;
+	now = config.tx_type != HWTSTAMP_TX_OFF ||
+		config.rx_filter != HWTSTAMP_FILTER_NONE;
+
+	if (now && !was) {
+		static_branch_inc(&mcp2515_hwtstamp_key);
+		spin_lock_irqsave(&priv->lock, flags);
+		priv->irq_tstamp_valid = 0;
+		priv->flags_tstamp = ktime_get_real();
+		spin_unlock_irqrestore(&priv->lock, flags);
+	} else if (was && !now)
+		static_branch_dec(&mcp2515_hwtstamp_key);
+	priv->hwts = config;
+
+	return copy_to_user(ifr->ifr_data, &config, sizeof(config)) ?
+		-EFAULT : 0;
+}
+
+static int mcp2515_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return mcp2515_set_hwtstamp(dev, ifr);
+	case SIOCGHWTSTAMP:
+		return copy_to_user(ifr->ifr_data, &priv->hwts,
+				    sizeof(priv->hwts)) ? -EFAULT : 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * Fold the per-CPU counters into what the CAN core keeps in dev->stats.
+ */
+static void mcp2515_get_stats64(struct net_device *dev,
+				struct rtnl_link_stats64 *stats)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int cpu;
+
+	netdev_stats_to_stats64(stats, &dev->stats);
+
+	for_each_possible_cpu(cpu) {
+		const struct mcp2515_pcpu_stats *pcpu =
+			per_cpu_ptr(priv->stats, cpu);
+		u64 rx_packets, rx_bytes, rx_dropped, rx_over_errors;
+		u64 tx_packets, tx_bytes, tx_dropped, tx_aborted_errors;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu->syncp);
+			rx_packets = pcpu->rx_packets;
+			rx_bytes = pcpu->rx_bytes;
+			rx_dropped = pcpu->rx_dropped;
+			rx_over_errors = pcpu->rx_over_errors;
+			tx_packets = pcpu->tx_packets;
+			tx_bytes = pcpu->tx_bytes;
+			tx_dropped = pcpu->tx_dropped;
+			tx_aborted_errors = pcpu->tx_aborted_errors;
+		} while (u64_stats_fetch_retry_irq(&pcpu->syncp, start));
+
+		stats->rx_packets += rx_packets;
+		stats->rx_bytes += rx_bytes;
+		stats->rx_dropped += rx_dropped;
+		stats->rx_over_errors += rx_over_errors;
+		stats->rx_errors += rx_over_errors;
+		stats->tx_packets += tx_packets;
+		stats->tx_bytes += tx_bytes;
+		stats->tx_dropped += tx_dropped;
+		stats->tx_aborted_errors += tx_aborted_errors;
+		stats->tx_errors += tx_aborted_errors;
+	}
+}
+
+static struct dentry *mcp2515_debugfs;
+
+static void mcp2515_id_count_show(struct seq_file *s,
+				  const struct mcp2515_id_stats *ids,
+				  const struct mcp2515_id_count *count,
+				  const char *fmt, canid_t can_id)
+{
+	struct mcp2515_id_count c;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin_irq(&ids->syncp);
+		c = *count;
+	} while (u64_stats_fetch_retry_irq(&ids->syncp, start));
+
+	if (!c.rx_frames && !c.tx_frames)
+		return;
+
+	seq_printf(s, fmt, can_id);
+	seq_printf(s, " %llu %llu %llu %llu\n", c.rx_frames, c.rx_bytes,
+		   c.tx_frames, c.tx_bytes);
+}
+
+/*
+ * Dump the per CAN ID statistics, under RTNL as close frees them.  Rates
+ * follow from two dumps, or from one and the time since counting
+ * started.
+ */
+static int mcp2515_id_stats_show(struct seq_file *s, void *unused)
+{
+	struct net_device *dev = s->private;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_id_stats *ids;
+	int i;
+
+	rtnl_lock();
+	ids = priv->id_stats;
+	if (!ids) {
+		seq_puts(s, "# disabled, see priv flag id-stats\n");
+		goto out;
+	}
+
+	seq_printf(s, "# %lld ms\n", ktime_ms_delta(ktime_get(), ids->start));
+	seq_puts(s, "# can_id rx_frames rx_bytes tx_frames tx_bytes\n");
+	for (i = 0; i <= CAN_SFF_MASK; i++)
+		mcp2515_id_count_show(s, ids, &ids->sff[i], "%03x", i);
+	for (i = 0; i < MCP2515_EFF_SLOTS; i++) {
+		const struct mcp2515_eff_count *e = &ids->eff[i];
+
+		if (e->can_id)
+			mcp2515_id_count_show(s, ids, &e->count, "%08x",
+					      e->can_id & CAN_EFF_MASK);
+	}
+	seq_printf(s, "# eff_untracked %llu\n", ids->eff_untracked);
+ out:
+	rtnl_unlock();
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mcp2515_id_stats);
+
+/*
+ * Dump the release jitter of the cyclic TX entries: how late their
+ * timers ran.
+ */
+static int mcp2515_tx_cyclic_stats_show(struct seq_file *s, void *unused)
+{
+	struct net_device *dev = s->private;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int i;
+
+	seq_puts(s, "# can_id sent late_last_ns late_avg_ns late_max_ns "
+		 "overruns rts_only\n");
+
+	mutex_lock(&priv->cfg_lock);
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++) {
+		const struct mcp2515_cyclic *c = &priv->cyclic[i];
+
+		if (!rcu_access_pointer(c->data))
+			continue;
+
+		seq_printf(s, c->can_id & CAN_EFF_FLAG ? "%08x" : "%03x",
+			   c->can_id & CAN_EFF_MASK);
+		seq_printf(s, " %llu %llu %llu %llu %llu %llu\n", c->sent,
+			   c->late_last_ns, c->late_avg_ns, c->late_max_ns,
+			   c->overruns, c->rts_only);
+	}
+	mutex_unlock(&priv->cfg_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mcp2515_tx_cyclic_stats);
+
+static int mcp2515_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Parse a software filter: standard IDs and ranges of them in hex
+ * ("123", "100-1ff"), extended IDs as 8 hex digits ("18fef100"), and
+ * "eff" for all extended IDs, separated by spaces or commas.  Returns 0
+ * for an empty list.
+ */
+static int mcp2515_sw_filter_parse(struct mcp2515_sw_filter *f, char *s)
+{
+	unsigned int i, n = 0;
+	char *tok, *end;
+	u32 lo, hi;
+	int tokens = 0;
+
+	while ((tok = strsep(&s, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+		tokens++;
+
+		if (!strcmp(tok, "eff")) {
+			f->eff_all = true;
+			continue;
+		}
+
+		if (strlen(tok) == 8) {
+			if (kstrtou32(tok, 16, &lo) || lo > CAN_EFF_MASK)
+				return -EINVAL;
+			if (f->eff_count == MCP2515_SW_FILTER_EFF_MAX)
+				return -ENOSPC;
+			f->eff[f->eff_count++] = lo;
+			continue;
+		}
+
+		end = strchr(tok, '-');
+		if (end)
+			*end++ = '\0';
+		if (kstrtou32(tok, 16, &lo))
+			return -EINVAL;
+		hi = lo;
+		if (end && kstrtou32(end, 16, &hi))
+			return -EINVAL;
+		if (lo > hi || hi > CAN_SFF_MASK)
+			return -EINVAL;
+		bitmap_set(f->sff, lo, hi - lo + 1);
+	}
+
+	sort(f->eff, f->eff_count, sizeof(f->eff[0]), mcp2515_cmp_u32, NULL);
+	for (i = 0; i < f->eff_count; i++)
+		if (!n || f->eff[i] != f->eff[n - 1])
+			f->eff[n++] = f->eff[i];
+	f->eff_count = n;
+
+	return tokens;
+}
+
+static ssize_t mcp2515_sw_filter_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+	const struct mcp2515_sw_filter *f;
+	unsigned int lo, hi, i;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	f = rcu_dereference(priv->sw_filter);
+	if (f) {
+		for (lo = find_first_bit(f->sff, CAN_SFF_MASK + 1);
+		     lo <= CAN_SFF_MASK;
+		     lo = find_next_bit(f->sff, CAN_SFF_MASK + 1, hi)) {
+			hi = find_next_zero_bit(f->sff, CAN_SFF_MASK + 1, lo);
+			if (hi - lo == 1)
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "%03x ", lo);
+			else
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "%03x-%03x ", lo, hi - 1);
+		}
+		if (f->eff_all)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "eff ");
+		for (i = 0; i < f->eff_count; i++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%08x ",
+					 f->eff[i]);
+	}
+	rcu_read_unlock();
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+/*
+ * Install a software filter, or with an empty list remove it.
+ */
+static ssize_t mcp2515_sw_filter_store(struct device *d,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+	struct mcp2515_sw_filter *f, *old;
+	char *s;
+	int err;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	s = kstrndup(buf, count, GFP_KERNEL);
+	if (!f || !s) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = mcp2515_sw_filter_parse(f, s);
+	if (err < 0)
+		goto out;
+	if (!err) {
+		kfree(f);
+		f = NULL;
+	}
+
+	mutex_lock(&priv->cfg_lock);
+	old = rcu_dereference_protected(priv->sw_filter,
+					lockdep_is_held(&priv->cfg_lock));
+	rcu_assign_pointer(priv->sw_filter, f);
+	if (f && !old)
+		static_branch_inc(&mcp2515_sw_filter_key);
+	else if (!f && old)
+		static_branch_dec(&mcp2515_sw_filter_key);
+	mutex_unlock(&priv->cfg_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+	kfree(s);
+
+	return count;
+
+ out:
+	kfree(s);
+	kfree(f);
+
+	return err;
+}
+
+static DEVICE_ATTR(sw_filter, 0644, mcp2515_sw_filter_show,
+		   mcp2515_sw_filter_store);
+
+static int mcp2515_cmp_rx_changed(const void *a, const void *b)
+{
+	const struct mcp2515_rx_changed_entry *x = a, *y = b;
+
+	return x->can_id < y->can_id ? -1 : x->can_id > y->can_id;
+}
+
+/*
+ * Parse a CAN ID as in sw_filter, with CAN_EFF_FLAG for an extended one.
+ */
+static int mcp2515_parse_can_id(const char *s, canid_t *can_id)
+{
+	u32 id;
+
+	if (kstrtou32(s, 16, &id))
+		return -EINVAL;
+
+	if (strlen(s) == 8) {
+		if (id > CAN_EFF_MASK)
+			return -EINVAL;
+		*can_id = id | CAN_EFF_FLAG;
+	} else {
+		if (id > CAN_SFF_MASK)
+			return -EINVAL;
+		*can_id = id;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a change filter: one ID per entry, as in sw_filter, optionally
+ * followed by "/" and a payload mask of 16 hex digits, and by "@" and a
+ * timeout in ms ("18fef100/ffff000000000000@1000"), separated by spaces
+ * or commas.  Returns the number of entries.
+ */
+static int mcp2515_rx_changed_parse(struct mcp2515_rx_changed *rc, char *s)
+{
+	char *tok, *mask, *timeout;
+	unsigned int i, ms;
+	u64 m;
+
+	while ((tok = strsep(&s, " ,\t\n"))) {
+		struct mcp2515_rx_changed_entry *e;
+
+		if (!*tok)
+			continue;
+		if (rc->count == MCP2515_RX_CHANGED_MAX)
+			return -ENOSPC;
+		e = &rc->entry[rc->count++];
+
+		timeout = strchr(tok, '@');
+		if (timeout)
+			*timeout++ = '\0';
+		mask = strchr(tok, '/');
+		if (mask)
+			*mask++ = '\0';
+
+		if (mcp2515_parse_can_id(tok, &e->can_id))
+			return -EINVAL;
+
+		m = U64_MAX;
+		if (mask && (strlen(mask) != 16 || kstrtou64(mask, 16, &m)))
+			return -EINVAL;
+		for (i = 0; i < CAN_MAX_DLEN; i++)
+			e->mask[i] = m >> (56 - 8 * i);
+
+		ms = 0;
+		if (timeout && kstrtouint(timeout, 10, &ms))
+			return -EINVAL;
+		e->timeout = ms_to_ktime(ms);
+	}
+
+	sort(rc->entry, rc->count, sizeof(rc->entry[0]),
+	     mcp2515_cmp_rx_changed, NULL);
+	for (i = 1; i < rc->count; i++)
+		if (rc->entry[i].can_id == rc->entry[i - 1].can_id)
+			return -EINVAL;
+
+	return rc->count;
+}
+
+static ssize_t mcp2515_rx_changed_show(struct device *d,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+	const struct mcp2515_rx_changed *rc;
+	ssize_t len = 0;
+	unsigned int i, j;
+
+	rcu_read_lock();
+	rc = rcu_dereference(priv->rx_changed);
+	for (i = 0; rc && i < rc->count; i++) {
+		const struct mcp2515_rx_changed_entry *e = &rc->entry[i];
+
+		if (e->can_id & CAN_EFF_FLAG)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%08x/",
+					 e->can_id & CAN_EFF_MASK);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%03x/",
+					 e->can_id);
+		for (j = 0; j < CAN_MAX_DLEN; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%02x",
+					 e->mask[j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "@%lld ",
+				 ktime_to_ms(e->timeout));
+	}
+	rcu_read_unlock();
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+/*
+ * Install a change filter, or with an empty list remove it.
+ */
+static ssize_t mcp2515_rx_changed_store(struct device *d,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+	struct mcp2515_rx_changed *rc, *old;
+	char *s;
+	int err;
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	s = kstrndup(buf, count, GFP_KERNEL);
+	if (!rc || !s) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = mcp2515_rx_changed_parse(rc, s);
+	if (err < 0)
+		goto out;
+	if (!err) {
+		kfree(rc);
+		rc = NULL;
+	}
+
+	mutex_lock(&priv->cfg_lock);
+	old = rcu_dereference_protected(priv->rx_changed,
+					lockdep_is_held(&priv->cfg_lock));
+	rcu_assign_pointer(priv->rx_changed, rc);
+	if (rc && !old)
+		static_branch_inc(&mcp2515_rx_changed_key);
+	else if (!rc && old)
+		static_branch_dec(&mcp2515_rx_changed_key);
+	mutex_unlock(&priv->cfg_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+	kfree(s);
+
+	return count;
+
+ out:
+	kfree(s);
+	kfree(rc);
+
+	return err;
+}
+
+static DEVICE_ATTR(rx_changed, 0644, mcp2515_rx_changed_show,
+		   mcp2515_rx_changed_store);
+
+static struct mcp2515_cyclic *mcp2515_cyclic_find(struct mcp2515_priv *priv,
+						  canid_t can_id)
+{
+	int i;
+
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+		if (rcu_access_pointer(priv->cyclic[i].data) &&
+		    priv->cyclic[i].can_id == can_id)
+			return &priv->cyclic[i];
+
+	return NULL;
+}
+
+/*
+ * Parse one cyclic TX command: "ID#DATA@PERIOD[+PHASE][:QUEUE][!]" adds
+ * an entry, with periods in us (100 at least) and the most urgent queue
+ * by default, "!" reserving the transmit buffer of the queue for it;
+ * "ID#DATA" swaps the payload of an entry; "-ID" removes one; "clear"
+ * removes all.  The new image is allocated here, so applying can't fail.
+ */
+static int mcp2515_cyclic_parse(char *tok, struct mcp2515_cyclic_cmd *cmd)
+{
+	char *data, *period, *phase, *queue;
+	struct can_frame cf = { };
+	int len;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->queue = MCP2515_TX_BUFS - 1;
+
+	if (!strcmp(tok, "clear")) {
+		cmd->clear = true;
+		return 0;
+	}
+
+	if (*tok == '-')
+		return mcp2515_parse_can_id(tok + 1, &cmd->can_id);
+
+	len = strlen(tok);
+	if (len && tok[len - 1] == '!') {
+		tok[len - 1] = '\0';
+		cmd->reserve = true;
+	}
+
+	data = strchr(tok, '#');
+	if (!data)
+		return -EINVAL;
+	*data++ = '\0';
+	queue = strchr(data, ':');
+	if (queue)
+		*queue++ = '\0';
+	period = strchr(data, '@');
+	if (period)
+		*period++ = '\0';
+	phase = period ? strchr(period, '+') : NULL;
+	if (phase)
+		*phase++ = '\0';
+
+	if (mcp2515_parse_can_id(tok, &cmd->can_id))
+		return -EINVAL;
+	cf.can_id = cmd->can_id;
+	len = strlen(data);
+	if (len % 2 || len / 2 > CAN_MAX_DLEN ||
+	    hex2bin(cf.data, data, len / 2))
+		return -EINVAL;
+	cf.can_dlc = len / 2;
+
+	if (period) {
+		if (kstrtouint(period, 10, &cmd->period_us) ||
+		    cmd->period_us < MCP2515_CYCLIC_PERIOD_MIN_US ||
+		    (phase && kstrtouint(phase, 10, &cmd->phase_us)) ||
+		    (queue && (kstrtouint(queue, 10, &cmd->queue) ||
+			       cmd->queue >= MCP2515_TX_BUFS)))
+			return -EINVAL;
+	} else if (queue || cmd->reserve) {
+		return -EINVAL;
+	}
+
+	cmd->data = kzalloc(sizeof(*cmd->data), GFP_KERNEL);
+	if (!cmd->data)
+		return -ENOMEM;
+	cmd->data->arb = mcp2515_arb_key(cf.can_id);
+	cmd->data->dlc = cf.can_dlc;
+	cmd->data->len = mcp2515_set_txbuf(cmd->data->data, &cf);
+
+	return 0;
+}
+
+/*
+ * Check that commands apply in order to the current entries: removed
+ * and updated entries exist, added ones don't and find a free entry,
+ * and a reserved buffer serves its entry only.  A period must also be
+ * longer than the frame at the current bitrate.  Called with cfg_lock
+ * held.
+ */
+static int mcp2515_cyclic_check(struct mcp2515_priv *priv,
+				const struct mcp2515_cyclic_cmd *cmd, int n)
+{
+	u32 bitrate = priv->can.bittiming.bitrate;
+	struct {
+		canid_t can_id;
+		u8 queue;
+		bool reserve;
+		bool used;
+	} e[MCP2515_CYCLIC_MAX];
+	int i;
+
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++) {
+		e[i].can_id = priv->cyclic[i].can_id;
+		e[i].queue = priv->cyclic[i].queue;
+		e[i].reserve = priv->cyclic[i].reserve;
+		e[i].used = rcu_access_pointer(priv->cyclic[i].data);
+	}
+
+	for (; n; n--, cmd++) {
+		if (cmd->clear) {
+			for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+				e[i].used = false;
+			continue;
+		}
+
+		for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+			if (e[i].used && e[i].can_id == cmd->can_id)
+				break;
+		if (!cmd->period_us) {
+			if (i == MCP2515_CYCLIC_MAX)
+				return -ENOENT;
+			if (!cmd->data)
+				e[i].used = false;
+			continue;
+		}
+		if (i < MCP2515_CYCLIC_MAX)
+			return -EEXIST;
+
+		if (bitrate &&
+		    (u64)cmd->period_us * bitrate <=
+		    (u64)mcp2515_frame_bits(cmd->can_id, cmd->data->dlc) *
+		    USEC_PER_SEC)
+			return -EINVAL;
+
+		for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+			if (e[i].used &&
+			    ((cmd->reserve && e[i].reserve) ||
+			     (e[i].queue == cmd->queue &&
+			      (cmd->reserve || e[i].reserve))))
+				return -EBUSY;
+
+		for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+			if (!e[i].used)
+				break;
+		if (i == MCP2515_CYCLIC_MAX)
+			return -ENOSPC;
+		e[i].can_id = cmd->can_id;
+		e[i].queue = cmd->queue;
+		e[i].reserve = cmd->reserve;
+		e[i].used = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply a checked command, taking its image.  Called with cfg_lock held.
+ */
+static void mcp2515_cyclic_apply(struct net_device *dev,
+				 struct mcp2515_cyclic_cmd *cmd)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_cyclic_data *d = cmd->data, *old;
+	struct mcp2515_cyclic *c;
+	int i;
+
+	if (cmd->clear) {
+		for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+			mcp2515_cyclic_remove(dev, &priv->cyclic[i]);
+		return;
+	}
+
+	c = mcp2515_cyclic_find(priv, cmd->can_id);
+	if (!d) {
+		mcp2515_cyclic_remove(dev, c);
+		return;
+	}
+
+	cmd->data = NULL;
+	d->seq = ++priv->cyclic_seq ? : ++priv->cyclic_seq;
+
+	if (!cmd->period_us) {
+		old = rcu_dereference_protected(c->data,
+					lockdep_is_held(&priv->cfg_lock));
+		rcu_assign_pointer(c->data, d);
+		kfree_rcu(old, rcu);
+		return;
+	}
+
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+		if (!rcu_access_pointer(priv->cyclic[i].data))
+			break;
+
+	c = &priv->cyclic[i];
+	c->can_id = cmd->can_id;
+	c->period = us_to_ktime(cmd->period_us);
+	c->phase = us_to_ktime(cmd->phase_us);
+	c->queue = cmd->queue;
+	c->reserve = cmd->reserve;
+	c->sent = 0;
+	c->rts_only = 0;
+	c->late_last_ns = 0;
+	c->late_avg_ns = 0;
+	c->late_max_ns = 0;
+	c->overruns = 0;
+	rcu_assign_pointer(c->data, d);
+
+	if (priv->cyclic_running) {
+		mcp2515_cyclic_pm(priv);
+		mcp2515_cyclic_arm(dev, c, ktime_get());
+	}
+}
+
+static ssize_t mcp2515_tx_cyclic_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+	ssize_t len = 0;
+	int i, j;
+
+	mutex_lock(&priv->cfg_lock);
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++) {
+		const struct mcp2515_cyclic *c = &priv->cyclic[i];
+		const struct mcp2515_cyclic_data *cd =
+			rcu_dereference_protected(c->data,
+				lockdep_is_held(&priv->cfg_lock));
+
+		if (!cd)
+			continue;
+
+		if (c->can_id & CAN_EFF_FLAG)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%08x#",
+					 c->can_id & CAN_EFF_MASK);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%03x#",
+					 c->can_id);
+		for (j = 0; j < cd->dlc; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%02x",
+					 cd->data[5 + j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "@%lld+%lld:%u%s\n", ktime_to_us(c->period),
+				 ktime_to_us(c->phase), c->queue,
+				 c->reserve ? "!" : "");
+	}
+	mutex_unlock(&priv->cfg_lock);
+
+	return len;
+}
+
+/*
+ * Apply cyclic TX commands separated by spaces, commas or newlines, all
+ * or, if any fails to parse or check, none.  Cyclic frames take
+ * transmit buffers from their TX queues, which the preemption mode
+ * manages differently, so it excludes them.  Sent cyclic frames are
+ * echoed to local sockets like the frames of sockets.
+ */
+static ssize_t mcp2515_tx_cyclic_store(struct device *d,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct net_device *dev = to_net_dev(d);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_cyclic_cmd *cmds;
+	char *s, *p, *tok;
+	int i, n = 0, err = 0;
+
+	s = kstrndup(buf, count, GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	/* Tokens are separated, so there are at most half as many */
+	cmds = kcalloc(count / 2 + 1, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds) {
+		kfree(s);
+		return -ENOMEM;
+	}
+
+	p = s;
+	while (!err && (tok = strsep(&p, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+		err = mcp2515_cyclic_parse(tok, &cmds[n++]);
+	}
+
+	mutex_lock(&priv->cfg_lock);
+	if (!err && (priv->priv_flags & MCP2515_PRIV_TX_PREEMPT))
+		err = -EBUSY;
+	if (!err)
+		err = mcp2515_cyclic_check(priv, cmds, n);
+	for (i = 0; !err && i < n; i++)
+		mcp2515_cyclic_apply(dev, &cmds[i]);
+	mcp2515_cyclic_pm(priv);
+	mutex_unlock(&priv->cfg_lock);
+
+	/* Images of commands not applied */
+	for (i = 0; i < n; i++)
+		kfree(cmds[i].data);
+	kfree(cmds);
+	kfree(s);
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR(tx_cyclic, 0644, mcp2515_tx_cyclic_show,
+		   mcp2515_tx_cyclic_store);
+
+static struct attribute *mcp2515_attrs[] = {
+	&dev_attr_sw_filter.attr,
+	&dev_attr_rx_changed.attr,
+	&dev_attr_tx_cyclic.attr,
+	NULL
+};
+
+static const struct attribute_group mcp2515_attr_group = {
+	.attrs = mcp2515_attrs,
+};
+
+/*
+ * Attach or detach an XDP program.
+ */
+static int mcp2515_xdp_setup(struct net_device *dev, struct bpf_prog *prog)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, prog);
+	if (prog && !old)
+		static_branch_inc(&mcp2515_xdp_key);
+	else if (!prog && old)
+		static_branch_dec(&mcp2515_xdp_key);
+	if (old)
+		bpf_prog_put(old);
+
+	return 0;
+}
+
+static int mcp2515_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return mcp2515_xdp_setup(dev, bpf->prog);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Network device operations.
+ */
+static const struct net_device_ops mcp2515_netdev_ops = {
+	.ndo_open = mcp2515_open,
+	.ndo_stop = mcp2515_close,
+	.ndo_start_xmit = mcp2515_start_xmit,
+	.ndo_select_queue = mcp2515_select_queue,
+	.ndo_tx_timeout = mcp2515_tx_timeout,
+	.ndo_get_stats64 = mcp2515_get_stats64,
+	.ndo_do_ioctl = mcp2515_ioctl,
+	.ndo_bpf = mcp2515_bpf,
+};
+
+#define MCP2515_XSTAT(name) \
+	{ #name, offsetof(struct mcp2515_xstats, name) }
+
+static const struct {
+	const char name[ETH_GSTRING_LEN];
+	size_t offset;
+} mcp2515_xstats_desc[] = {
+	MCP2515_XSTAT(rx_rxb0),
+	MCP2515_XSTAT(rx_rxb1),
+	MCP2515_XSTAT(rx_rollover),
+	MCP2515_XSTAT(rx_alloc_failed),
+	MCP2515_XSTAT(rx_sw_filtered),
+	MCP2515_XSTAT(rx_unchanged),
+	MCP2515_XSTAT(xdp_pass),
+	MCP2515_XSTAT(xdp_drop),
+	MCP2515_XSTAT(xdp_redirect),
+	MCP2515_XSTAT(xdp_aborted),
+	MCP2515_XSTAT(rx_ring_high_water),
+	MCP2515_XSTAT(rx_ring_overflow),
+	MCP2515_XSTAT(tx_preempted),
+	MCP2515_XSTAT(tx_preempt_late),
+	MCP2515_XSTAT(tx_abort_requests),
+	MCP2515_XSTAT(spi_errors),
+	MCP2515_XSTAT(tx_timeout),
+	MCP2515_XSTAT(tx_timeout_aborted),
+	MCP2515_XSTAT(tx_timeout_completed),
+	MCP2515_XSTAT(stall_rescued_busy),
+	MCP2515_XSTAT(stall_rescued_idle),
+	MCP2515_XSTAT(runtime_suspends),
+	MCP2515_XSTAT(bus_wakeups),
+	MCP2515_XSTAT(wake_latency_last_us),
+	MCP2515_XSTAT(wake_latency_max_us),
+	MCP2515_XSTAT(mode_change_last_us),
+	MCP2515_XSTAT(mode_change_max_us),
+	MCP2515_XSTAT(budget_exhausted),
+	MCP2515_XSTAT(rx_path_ns_avg),
+	MCP2515_XSTAT(rx_path_ns_max),
+	MCP2515_XSTAT(tx_path_ns_avg),
+	MCP2515_XSTAT(tx_path_ns_max),
+	MCP2515_XSTAT(spi_queued),
+	MCP2515_XSTAT(spi_queued_overflow),
+	MCP2515_XSTAT(spi_queue_wait_last_us),
+	MCP2515_XSTAT(spi_queue_wait_max_us),
+};
+
+static const char mcp2515_priv_flags_strings[][ETH_GSTRING_LEN] = {
+	"tx-preempt",
+	"id-stats",
+};
+
+static void mcp2515_get_ringparam(struct net_device *dev,
+				  struct ethtool_ringparam *ring)
+{
+	const struct mcp2515_priv *priv = netdev_priv(dev);
 
-	return NETDEV_TX_OK;
+	ring->rx_max_pending = MCP2515_RX_RING_MAX;
+	ring->rx_pending = priv->rx_ring_size;
+	ring->tx_max_pending = 1;
+	ring->tx_pending = 1;
 }
 
 /*
- * Called when the network device transitions to the up state.
+ * Resize the RX ring.  The ring only exists while the interface is up,
+ * so this is refused on a running interface.
  */
-static int mcp2515_open(struct net_device *dev)
+static int mcp2515_set_ringparam(struct net_device *dev,
+				 struct ethtool_ringparam *ring)
 {
 	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct spi_device *spi = priv->spi;
-	int err;
 
-	mcp2515_power_switch(priv, 1);
-
-	err = open_candev(dev);
-	if (err)
-		goto failed_open;
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending ||
+	    ring->tx_pending != 1)
+		return -EINVAL;
 
-	err = request_irq(spi->irq, mcp2515_interrupt,
-			  IRQF_TRIGGER_FALLING, dev->name, dev);
-	if (err)
-		goto failed_irq;
+	if (ring->rx_pending < MCP2515_RX_RING_MIN ||
+	    ring->rx_pending > MCP2515_RX_RING_MAX)
+		return -EINVAL;
 
-	err = mcp2515_chip_start(dev);
-	if (err)
-		goto failed_start;
+	if (netif_running(dev))
+		return -EBUSY;
 
-	netif_start_queue(dev);
+	priv->rx_ring_size = roundup_pow_of_two(ring->rx_pending);
 
 	return 0;
-
- failed_start:
-	free_irq(spi->irq, dev);
- failed_irq:
-	close_candev(dev);
- failed_open:
-	mcp2515_power_switch(priv, 0);
-	return err;
 }
 
-/*
- * Called when the network device transitions to the down state.
- */
-static int mcp2515_close(struct net_device *dev)
+static int mcp2515_get_sset_count(struct net_device *dev, int sset)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct spi_device *spi = priv->spi;
-
-	netif_stop_queue(dev);
-	mcp2515_chip_stop(dev);
-	free_irq(spi->irq, dev);
-
-	mcp2515_power_switch(priv, 0);
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(mcp2515_xstats_desc);
+	case ETH_SS_PRIV_FLAGS:
+		return ARRAY_SIZE(mcp2515_priv_flags_strings);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
 
-	close_candev(dev);
+static void mcp2515_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	int i;
 
-	return 0;
+	switch (sset) {
+	case ETH_SS_STATS:
+		for (i = 0; i < ARRAY_SIZE(mcp2515_xstats_desc); i++)
+			memcpy(data + i * ETH_GSTRING_LEN,
+			       mcp2515_xstats_desc[i].name, ETH_GSTRING_LEN);
+		break;
+	case ETH_SS_PRIV_FLAGS:
+		memcpy(data, mcp2515_priv_flags_strings,
+		       sizeof(mcp2515_priv_flags_strings));
+		break;
+	}
 }
 
 /*
- * Set up SPI messages.
+ * Each statistic is either a per CPU counter or a gauge of the device,
+ * and zero in the other places: summing them all gives its value.
  */
-static void mcp2515_setup_spi_messages(struct net_device *dev)
+static void mcp2515_get_ethtool_stats(struct net_device *dev,
+				      struct ethtool_stats *stats, u64 *data)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-	struct device *device;
-	void *buf;
-	dma_addr_t dma;
+	const struct mcp2515_priv *priv = netdev_priv(dev);
+	struct mcp2515_xstats sum, x;
+	const u64 *src = (const u64 *)&x;
+	u64 *dst = (u64 *)&sum;
+	unsigned int start;
+	int cpu, i;
 
-	spi_message_init(&priv->message);
-	priv->message.context = dev;
+	BUILD_BUG_ON(sizeof(x) % sizeof(u64));
 
-	/* FIXME */
-	device = &priv->spi->dev;
-	device->coherent_dma_mask = 0xffffffff;
+	do {
+		start = u64_stats_fetch_begin_irq(&priv->xstats_syncp);
+		sum = priv->xstats;
+	} while (u64_stats_fetch_retry_irq(&priv->xstats_syncp, start));
 
-	BUILD_BUG_ON(MCP2515_DMA_SIZE <
-		     sizeof(priv->tx_buf) + sizeof(priv->rx_buf));
+	for_each_possible_cpu(cpu) {
+		const struct mcp2515_pcpu_stats *pcpu =
+			per_cpu_ptr(priv->stats, cpu);
 
-	buf = dma_alloc_coherent(device, MCP2515_DMA_SIZE, &dma, GFP_KERNEL);
-	if (buf) {
-		priv->transfer.tx_buf = buf;
-		priv->transfer.rx_buf = buf + MCP2515_DMA_SIZE / 2;
-		priv->transfer.tx_dma = dma;
-		priv->transfer.rx_dma = dma + MCP2515_DMA_SIZE / 2;
-		priv->message.is_dma_mapped = 1;
-	} else {
-		priv->transfer.tx_buf = priv->tx_buf;
-		priv->transfer.rx_buf = priv->rx_buf;
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu->syncp);
+			x = pcpu->xstats;
+		} while (u64_stats_fetch_retry_irq(&pcpu->syncp, start));
+
+		for (i = 0; i < sizeof(x) / sizeof(u64); i++)
+			dst[i] += src[i];
 	}
 
-	spi_message_add_tail(&priv->transfer, &priv->message);
+	for (i = 0; i < ARRAY_SIZE(mcp2515_xstats_desc); i++)
+		data[i] = *(const u64 *)((const u8 *)&sum +
+					 mcp2515_xstats_desc[i].offset);
 }
 
-static void mcp2515_cleanup_spi_messages(struct net_device *dev)
+static u32 mcp2515_get_priv_flags(struct net_device *dev)
 {
-	struct mcp2515_priv *priv = netdev_priv(dev);
-
-	if (!priv->message.is_dma_mapped)
-		return;
+	const struct mcp2515_priv *priv = netdev_priv(dev);
 
-	dma_free_coherent(&priv->spi->dev, MCP2515_DMA_SIZE,
-			  (void *)priv->transfer.tx_buf, priv->transfer.tx_dma);
+	return priv->priv_flags;
 }
 
-static int mcp2515_set_mode(struct net_device *dev, enum can_mode mode)
+/*
+ * The transmit path can't change mode with frames in flight, and the per
+ * CAN ID statistics are set up on open, so this is refused on a running
+ * interface.  Preemption also excludes cyclic TX entries.
+ */
+static int mcp2515_set_priv_flags(struct net_device *dev, u32 flags)
 {
-	int err;
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int i, err = 0;
 
-	switch (mode) {
-	case CAN_MODE_START:
-		err = mcp2515_chip_start(dev);
-		if (err)
-			return err;
+	if (flags & ~(MCP2515_PRIV_TX_PREEMPT | MCP2515_PRIV_ID_STATS))
+		return -EINVAL;
 
-		netif_wake_queue(dev);
-		break;
+	if (flags != priv->priv_flags && netif_running(dev))
+		return -EBUSY;
 
-	default:
-		return -EOPNOTSUPP;
-	}
+	/* Against tx_cyclic_store adding an entry meanwhile */
+	mutex_lock(&priv->cfg_lock);
+	if (flags & MCP2515_PRIV_TX_PREEMPT)
+		for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+			if (rcu_access_pointer(priv->cyclic[i].data))
+				err = -EBUSY;
+	if (!err)
+		priv->priv_flags = flags;
+	mutex_unlock(&priv->cfg_lock);
 
-	return 0;
+	return err;
 }
 
-static int mcp2515_get_berr_counter(const struct net_device *dev,
-				    struct can_berr_counter *bec)
+/*
+ * The chip has no timestamp counter: the time of the interrupt that
+ * signals a received or transmitted frame is reported as its hardware
+ * timestamp.
+ */
+static int mcp2515_get_ts_info(struct net_device *dev,
+			       struct ethtool_ts_info *info)
 {
-	const struct mcp2515_priv *priv = netdev_priv(dev);
-	int err;
-	u8 reg_tec, reg_rec;
-
-	err = mcp2515_read_2regs(priv->spi, TEC, &reg_tec, &reg_rec);
-	if (err)
-		return err;
-
-	bec->txerr = reg_tec;
-	bec->rxerr = reg_rec;
+	info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+		SOF_TIMESTAMPING_TX_HARDWARE |
+		SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE |
+		SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
 
 	return 0;
 }
 
 /*
- * Network device operations.
+ * Ethtool operations.
  */
-static const struct net_device_ops mcp2515_netdev_ops = {
-	.ndo_open = mcp2515_open,
-	.ndo_stop = mcp2515_close,
-	.ndo_start_xmit = mcp2515_start_xmit,
+static const struct ethtool_ops mcp2515_ethtool_ops = {
+	.get_ringparam = mcp2515_get_ringparam,
+	.set_ringparam = mcp2515_set_ringparam,
+	.get_sset_count = mcp2515_get_sset_count,
+	.get_strings = mcp2515_get_strings,
+	.get_ethtool_stats = mcp2515_get_ethtool_stats,
+	.get_ts_info = mcp2515_get_ts_info,
+	.get_priv_flags = mcp2515_get_priv_flags,
+	.set_priv_flags = mcp2515_set_priv_flags,
 };
 
 static int mcp2515_register_candev(struct net_device *dev)
@@ -957,7 +5381,7 @@ static int mcp2515_register_candev(struct net_device *dev)
 
 	mcp2515_board_specific_setup(priv);
 	mcp2515_power_switch(priv, 1);
-	mcp2515_hw_reset(spi);
+	mcp2515_hw_reset(priv);
 
 	/*
 	 * Please note that these are "magic values" based on after
@@ -1000,22 +5424,66 @@ static void mcp2515_unregister_candev(struct net_device *dev)
 }
 
 /*
- * Binds this driver to the spi device.
+ * Get an optional supply: absent is fine, anything else is an error
+ * (including -EPROBE_DEFER).
+ */
+static struct regulator *mcp2515_get_supply(struct device *d,
+					    const char *id)
+{
+	struct regulator *reg = devm_regulator_get_optional(d, id);
+
+	if (PTR_ERR(reg) == -ENODEV)
+		return NULL;
+
+	return reg;
+}
+
+/*
+ * Binds this driver to the spi device.  The oscillator frequency comes
+ * from platform data, else from the clocks of the device, else from its
+ * "clock-frequency" property.
  */
 static int mcp2515_probe(struct spi_device *spi)
 {
 	struct net_device *dev;
 	struct mcp2515_priv *priv;
 	struct mcp251x_platform_data *pdata = spi->dev.platform_data;
-	int err;
+	struct regulator *power, *transceiver;
+	struct clk *clk;
+	u32 freq = 0;
+	int i, err;
+
+	clk = devm_clk_get_optional(&spi->dev, NULL);
+	if (IS_ERR(clk))
+		return PTR_ERR(clk);
+
+	power = mcp2515_get_supply(&spi->dev, "vdd");
+	if (IS_ERR(power))
+		return PTR_ERR(power);
+
+	transceiver = mcp2515_get_supply(&spi->dev, "xceiver");
+	if (IS_ERR(transceiver))
+		return PTR_ERR(transceiver);
+
+	if (pdata)
+		freq = pdata->oscillator_frequency;
+	else if (clk)
+		freq = clk_get_rate(clk);
+	else
+		device_property_read_u32(&spi->dev, "clock-frequency", &freq);
 
-	if (!pdata) {
-		/* Platform data is required for osc freq */
-		err = -ENODEV;
-		goto failed_pdata;
+	if (freq < MCP2515_OSC_MIN || freq > MCP2515_OSC_MAX) {
+		dev_err(&spi->dev, "oscillator frequency %u Hz not supported\n",
+			freq);
+		return -ERANGE;
 	}
 
-	dev = alloc_candev(sizeof(struct mcp2515_priv), 1);
+	err = clk_prepare_enable(clk);
+	if (err)
+		goto failed_clk;
+
+	dev = alloc_candev_mqs(sizeof(struct mcp2515_priv), MCP2515_TX_BUFS,
+			       MCP2515_TX_BUFS, 1);
 	if (!dev) {
 		err = -ENOMEM;
 		goto failed_alloc;
@@ -1025,11 +5493,14 @@ static int mcp2515_probe(struct spi_device *spi)
 	SET_NETDEV_DEV(dev, &spi->dev);
 
 	dev->netdev_ops = &mcp2515_netdev_ops;
+	dev->ethtool_ops = &mcp2515_ethtool_ops;
 	dev->flags |= IFF_ECHO;
+	dev->watchdog_timeo = MCP2515_TX_TIMEOUT;
+	dev->sysfs_groups[0] = &mcp2515_attr_group;
 
 	priv = netdev_priv(dev);
 	priv->can.bittiming_const = &mcp2515_bittiming_const;
-	priv->can.clock.freq = pdata->oscillator_frequency / 2;
+	priv->can.clock.freq = freq / 2;
 	priv->can.ctrlmode_supported = CAN_CTRLMODE_LOOPBACK |
 		CAN_CTRLMODE_LISTENONLY | CAN_CTRLMODE_3_SAMPLES |
 		CAN_CTRLMODE_ONE_SHOT;
@@ -1037,28 +5508,79 @@ static int mcp2515_probe(struct spi_device *spi)
 	priv->can.do_get_berr_counter = mcp2515_get_berr_counter;
 	priv->spi = spi;
 	priv->pdata = pdata;
+	priv->clk = clk;
+	priv->power = power;
+	priv->transceiver = transceiver;
+	priv->rx_ring_size = MCP2515_RX_RING_DEFAULT;
+
+	netif_napi_add(dev, &priv->napi, mcp2515_poll, MCP2515_NAPI_WEIGHT);
 
 	spin_lock_init(&priv->lock);
+	spin_lock_init(&priv->xstats_lock);
+	u64_stats_init(&priv->xstats_syncp);
+	mutex_init(&priv->reg_lock);
+	mutex_init(&priv->cfg_lock);
+	init_completion(&priv->idle);
+	INIT_DELAYED_WORK(&priv->stall_work, mcp2515_stall_work);
+	hrtimer_init(&priv->yield_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->yield_timer.function = mcp2515_yield_timer;
+	priv->yield_resume = mcp2515_read_flags;
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++) {
+		hrtimer_init(&priv->cyclic[i].timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS_SOFT);
+		priv->cyclic[i].timer.function = mcp2515_cyclic_timer;
+		priv->cyclic[i].dev = dev;
+	}
+	priv->txb_reserved = -1;
+
+	priv->stats = netdev_alloc_pcpu_stats(struct mcp2515_pcpu_stats);
+	if (!priv->stats) {
+		err = -ENOMEM;
+		goto failed_stats;
+	}
 
 	mcp2515_setup_spi_messages(dev);
 
+	err = mcp2515_spi_bus_get(priv);
+	if (err)
+		goto failed_bus;
+
 	err = mcp2515_register_candev(dev);
 	if (err) {
 		netdev_err(dev, "registering netdev failed");
 		goto failed_register;
 	}
 
+	priv->debugfs = debugfs_create_dir(dev_name(&spi->dev),
+					   mcp2515_debugfs);
+	debugfs_create_file("id_stats", 0444, priv->debugfs, dev,
+			    &mcp2515_id_stats_fops);
+	debugfs_create_file("tx_cyclic", 0444, priv->debugfs, dev,
+			    &mcp2515_tx_cyclic_stats_fops);
+
+	device_set_wakeup_capable(&spi->dev, true);
+	pm_runtime_set_autosuspend_delay(&spi->dev, MCP2515_AUTOSUSPEND_MS);
+	pm_runtime_use_autosuspend(&spi->dev);
+	pm_runtime_set_active(&spi->dev);
+	pm_runtime_forbid(&spi->dev);
+	pm_runtime_enable(&spi->dev);
+
 	netdev_info(dev, "device registered (cs=%u, irq=%d)\n",
 		    spi->chip_select, spi->irq);
 
 	return 0;
 
  failed_register:
+	mcp2515_spi_bus_put(priv);
+ failed_bus:
 	mcp2515_cleanup_spi_messages(dev);
+	free_percpu(priv->stats);
+ failed_stats:
 	dev_set_drvdata(&spi->dev, NULL);
 	free_candev(dev);
  failed_alloc:
- failed_pdata:
+	clk_disable_unprepare(clk);
+ failed_clk:
 	return err;
 }
 
@@ -1068,23 +5590,308 @@ static int mcp2515_probe(struct spi_device *spi)
 static int mcp2515_remove(struct spi_device *spi)
 {
 	struct net_device *dev = dev_get_drvdata(&spi->dev);
-
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct clk *clk = priv->clk;
+	int i;
+
+	pm_runtime_disable(&spi->dev);
+	pm_runtime_allow(&spi->dev);
+	pm_runtime_set_suspended(&spi->dev);
+	pm_runtime_dont_use_autosuspend(&spi->dev);
+	debugfs_remove_recursive(priv->debugfs);
 	mcp2515_unregister_candev(dev);
+	hrtimer_cancel(&priv->yield_timer);
+	if (rcu_access_pointer(priv->sw_filter)) {
+		static_branch_dec(&mcp2515_sw_filter_key);
+		kfree_rcu(rcu_access_pointer(priv->sw_filter), rcu);
+	}
+	if (rcu_access_pointer(priv->rx_changed)) {
+		static_branch_dec(&mcp2515_rx_changed_key);
+		kfree_rcu(rcu_access_pointer(priv->rx_changed), rcu);
+	}
+	for (i = 0; i < MCP2515_CYCLIC_MAX; i++)
+		if (rcu_access_pointer(priv->cyclic[i].data))
+			kfree_rcu(rcu_access_pointer(priv->cyclic[i].data),
+				  rcu);
+	if (priv->hwts.tx_type != HWTSTAMP_TX_OFF ||
+	    priv->hwts.rx_filter != HWTSTAMP_FILTER_NONE)
+		static_branch_dec(&mcp2515_hwtstamp_key);
+	mcp2515_spi_bus_put(priv);
 	mcp2515_cleanup_spi_messages(dev);
+	free_percpu(priv->stats);
 	dev_set_drvdata(&spi->dev, NULL);
 	free_candev(dev);
+	clk_disable_unprepare(clk);
+
+	return 0;
+}
+
+/*
+ * Put the chip in sleep mode, with the wakeup interrupt enabled.  Its
+ * registers are kept, so no reconfiguration is needed on wakeup.
+ */
+static int __maybe_unused mcp2515_runtime_suspend(struct device *d)
+{
+	struct net_device *dev = dev_get_drvdata(d);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+	unsigned long flags;
+	int err;
+
+	if (!priv->pm_up)
+		return 0;
+
+	/* No polls of a sleeping chip; resume or a failure restarts them */
+	cancel_delayed_work_sync(&priv->stall_work);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (priv->busy) {
+		spin_unlock_irqrestore(&priv->lock, flags);
+		mcp2515_pm_wake_queues(dev);
+		schedule_delayed_work(&priv->stall_work,
+				      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+		pm_runtime_mark_last_busy(d);
+		return -EBUSY;
+	}
+	priv->asleep = 1;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	/* Idle, so not yielded: no timer may start SPI on the sleeping chip */
+	hrtimer_cancel(&priv->yield_timer);
+
+	err = mcp2515_bit_modify(spi, CANINTF, CANINTF_WAKIF, 0);
+	if (!err)
+		err = mcp2515_reg_update(priv, CANINTE, CANINTE_WAKIE,
+					 CANINTE_WAKIE);
+	if (!err)
+		err = mcp2515_hw_sleep(priv);
+	if (!err)
+		err = mcp2515_wait_for_mode(priv, CANCTRL_REQOP_SLEEP);
+	if (err) {
+		mcp2515_reg_write(priv, CANCTRL, mcp2515_ctrl_mode(priv));
+		mcp2515_reg_update(priv, CANINTE, CANINTE_WAKIE, 0);
+		mcp2515_pm_wake_queues(dev);
+		schedule_delayed_work(&priv->stall_work,
+				      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+		return err;
+	}
+
+	mcp2515_stats_add(priv, xstats.runtime_suspends, 1);
+
+	return 0;
+}
+
+/*
+ * Bring the chip back to its operation mode, from sleep mode or from the
+ * listen-only mode a bus wakeup leaves it in, and account the latency
+ * from the wake event.
+ */
+static int __maybe_unused mcp2515_runtime_resume(struct device *d)
+{
+	struct net_device *dev = dev_get_drvdata(d);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+	ktime_t start = ktime_get_real();
+	unsigned long flags;
+	u8 mode = mcp2515_ctrl_mode(priv);
+	s64 us;
+	int err;
+
+	if (!priv->pm_up)
+		return 0;
+
+	err = mcp2515_reg_write(priv, CANCTRL, mode);
+	if (!err)
+		err = mcp2515_wait_for_mode(priv, mode);
+	if (err)
+		return err;
+
+	mcp2515_reg_update(priv, CANINTE, CANINTE_WAKIE, 0);
+	mcp2515_bit_modify(spi, CANINTF, CANINTF_WAKIF, 0);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (priv->wake_tstamp)
+		start = priv->wake_tstamp;
+	priv->wake_tstamp = 0;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	us = ktime_us_delta(ktime_get_real(), start);
+	if (us >= 0) {
+		mcp2515_gauge(priv, &priv->xstats.wake_latency_last_us,
+			      &priv->xstats.wake_latency_max_us, us);
+	}
+
+	mcp2515_pm_wake_queues(dev);
+	schedule_delayed_work(&priv->stall_work,
+			      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+	pm_runtime_mark_last_busy(d);
+
+	return 0;
+}
+
+/*
+ * Abort the frames pending in the transmit buffers and drop the staged
+ * ones, so that none goes out long after its time, or keeps its TX
+ * queue stopped, across a system suspend.  A frame on the bus completes
+ * first.  The interrupt is kept off meanwhile, as the SPI engine would
+ * complete the same frames.  Errors are only reported: the frames are
+ * released anyway, like the chip would be stopped.
+ * Synchronous.
+ */
+static void mcp2515_abort_tx_frames(struct net_device *dev)
+{
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	struct spi_device *spi = priv->spi;
+	const u8 cmd = MCP2515_INSTRUCTION_READ_STATUS;
+	unsigned long timeout = jiffies + HZ;
+	u8 status = 0;
+	int err, n;
+
+	for (n = 0; n < MCP2515_TX_BUFS; n++)
+		if (priv->tx_frame[n].used)
+			break;
+	if (n == MCP2515_TX_BUFS) {
+		mcp2515_flush_staged(dev);
+		return;
+	}
+
+	disable_irq(spi->irq);
+	mcp2515_wait_idle(dev);
+
+	err = mcp2515_reg_update(priv, CANCTRL, CANCTRL_ABAT, CANCTRL_ABAT);
+	while (!err) {
+		err = spi_write_then_read(spi, &cmd, 1, &status, 1);
+		if (err || !(status & STATUS_TXREQ_ALL))
+			break;
+		if (time_after(jiffies, timeout)) {
+			err = -ETIMEDOUT;
+			break;
+		}
+		usleep_range(100, 200);
+	}
+	if (err)
+		netdev_warn(dev, "aborting transmissions failed: %d\n", err);
+
+	mcp2515_release_tx_frames(dev, status);
+	mcp2515_reg_update(priv, CANCTRL, CANCTRL_ABAT, 0);
+	mcp2515_bit_modify(spi, CANINTF, CANINTF_TX, 0);
+
+	enable_irq(spi->irq);
+}
+
+/*
+ * System suspend: the chip sleeps as in runtime suspend, and wakes the
+ * system on bus activity if wakeup is enabled.  The cyclic TX entries
+ * stop with it and restart, phases anew, on resume.  Pending frames are
+ * aborted first, so the transceiver is not switched off under one, and
+ * every TX queue is free again on resume.
+ */
+static int __maybe_unused mcp2515_suspend(struct device *d)
+{
+	struct net_device *dev = dev_get_drvdata(d);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int err;
+
+	if (netif_running(dev)) {
+		netif_device_detach(dev);
+		mcp2515_cyclic_stop(dev);
+		cancel_delayed_work_sync(&priv->stall_work);
+		mcp2515_wait_idle(dev);
+		mcp2515_abort_tx_frames(dev);
+	}
+
+	err = pm_runtime_force_suspend(d);
+	if (err) {
+		if (netif_running(dev)) {
+			netif_device_attach(dev);
+			mcp2515_cyclic_start(dev);
+		}
+		return err;
+	}
+
+	if (netif_running(dev) && device_may_wakeup(d))
+		enable_irq_wake(priv->spi->irq);
+	else
+		mcp2515_transceiver_switch(priv, 0);
+
+	return 0;
+}
+
+static int __maybe_unused mcp2515_resume(struct device *d)
+{
+	struct net_device *dev = dev_get_drvdata(d);
+	struct mcp2515_priv *priv = netdev_priv(dev);
+	int err;
+
+	if (netif_running(dev) && device_may_wakeup(d))
+		disable_irq_wake(priv->spi->irq);
+	else if (netif_running(dev))
+		mcp2515_transceiver_switch(priv, 1);
+
+	err = pm_runtime_force_resume(d);
+	if (err)
+		return err;
+
+	if (netif_running(dev)) {
+		netif_device_attach(dev);
+		schedule_delayed_work(&priv->stall_work,
+				      msecs_to_jiffies(MCP2515_STALL_POLL_MS));
+		mcp2515_cyclic_start(dev);
+	}
 
 	return 0;
 }
 
+static const struct dev_pm_ops mcp2515_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(mcp2515_suspend, mcp2515_resume)
+	SET_RUNTIME_PM_OPS(mcp2515_runtime_suspend, mcp2515_runtime_resume,
+			   NULL)
+};
+
+static const struct of_device_id mcp2515_of_match[] = {
+	{ .compatible = "microchip,mcp2515" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, mcp2515_of_match);
+
+static const struct spi_device_id mcp2515_id_table[] = {
+	{ "mcp2515", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, mcp2515_id_table);
+
 static struct spi_driver mcp2515_can_driver = {
 	.driver = {
 		.name = KBUILD_MODNAME,
 		.owner = THIS_MODULE,
+		.of_match_table = mcp2515_of_match,
+		.pm = &mcp2515_pm_ops,
+		/* chip detection is SPI bound, don't hold up the boot */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
+	.id_table = mcp2515_id_table,
 	.probe = mcp2515_probe,
 	.remove = mcp2515_remove,
 };
 
-module_spi_driver(mcp2515_can_driver);
+static int __init mcp2515_init(void)
+{
+	int err;
+
+	mcp2515_debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	err = spi_register_driver(&mcp2515_can_driver);
+	if (err)
+		debugfs_remove_recursive(mcp2515_debugfs);
+
+	return err;
+}
+module_init(mcp2515_init);
+
+static void __exit mcp2515_exit(void)
+{
+	spi_unregister_driver(&mcp2515_can_driver);
+	debugfs_remove_recursive(mcp2515_debugfs);
+}
+module_exit(mcp2515_exit);
 